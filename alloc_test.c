@@ -0,0 +1,183 @@
+/* Checks of the block allocator and of writes through it. bfs.c is compiled
+   in with its main renamed, like bench.c. The allocator checks only work on
+   the in-memory bitmaps; the write checks use a scratch disk image in /tmp. */
+#define main bfs_main
+#include "bfs.c"
+#undef main
+
+int failures = 0;
+
+#define CHECK(cond)                                                       \
+    do                                                                    \
+    {                                                                     \
+        if (!(cond))                                                      \
+        {                                                                 \
+            fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                   \
+        }                                                                 \
+    } while (0)
+
+// Marks every data block used except [first, first + count), clears the
+// dirty range and puts the next-fit cursor at word cursor
+void setup_bitmap(int first, int count, int cursor)
+{
+    memset(bitmap, 0xff, sizeof(bitmap));
+    for (int b = first; b < first + count; b++)
+        bitmap[b / 8] &= ~(1 << (b % 8));
+    free_block_count = count_free_blocks();
+    alloc_cursor = cursor;
+    bitmap_dirty_start = BLOCK_SIZE;
+    bitmap_dirty_end = 0;
+}
+
+// A run at the very end of the volume, behind the cursor, shorter than asked
+void test_tail_run_behind_cursor()
+{
+    int count = -1;
+    setup_bitmap(TOTAL_BLOCKS - 6, 6, 10);
+    int start = alloc_blocks(-1, 16, &count);
+    CHECK(start == TOTAL_BLOCKS - 6);
+    CHECK(count == 6);
+    CHECK(free_block_count == 0);
+    CHECK(bitmap_dirty_start == (TOTAL_BLOCKS - 6) / 8);
+    CHECK(bitmap_dirty_end == TOTAL_BLOCKS / 8);
+}
+
+// The tail run is shorter than one found after the wrap: the longer one wins
+void test_longer_run_after_wrap()
+{
+    int count = -1;
+    setup_bitmap(TOTAL_BLOCKS - 6, 6, 10);
+    for (int b = DATA_BLOCK_START; b < DATA_BLOCK_START + 8; b++)
+        bitmap[b / 8] &= ~(1 << (b % 8));
+    free_block_count = count_free_blocks();
+    int start = alloc_blocks(-1, 16, &count);
+    CHECK(start == DATA_BLOCK_START);
+    CHECK(count == 8);
+}
+
+// A full volume leaves the bitmap, dirty range and cursor alone
+void test_full_volume()
+{
+    int count = -1;
+    setup_bitmap(0, 0, 10);
+    CHECK(alloc_blocks(-1, 16, &count) == -1);
+    CHECK(bitmap_dirty_start == BLOCK_SIZE && bitmap_dirty_end == 0);
+    CHECK(alloc_cursor == 10);
+}
+
+// Fills every data block of the scratch image with a freed file's bytes
+// (0xaa), marks every step-th data block used and empties inode 0
+void setup_fragmented_disk(int step)
+{
+    char block[BLOCK_SIZE];
+    memset(block, 0xaa, sizeof(block));
+    for (int b = DATA_BLOCK_START; b < TOTAL_BLOCKS; b++)
+        pwrite(fd_disk, block, BLOCK_SIZE, (off_t)b * BLOCK_SIZE);
+    cache_invalidate(DATA_BLOCK_START, TOTAL_BLOCKS - DATA_BLOCK_START);
+
+    setup_bitmap(DATA_BLOCK_START, TOTAL_BLOCKS - DATA_BLOCK_START, DATA_BLOCK_START / 64);
+    for (int b = DATA_BLOCK_START; b < TOTAL_BLOCKS; b += step)
+        bitmap[b / 8] |= 1 << (b % 8);
+    free_block_count = count_free_blocks();
+    memset(&inodes[0], 0, sizeof(Inode));
+    memset(indirect_cache, 0, sizeof(indirect_cache));
+}
+
+// Whether bytes [start, end) of inode 0 read back as zeros
+int reads_zero(off_t start, off_t end)
+{
+    char buf[BLOCK_SIZE * 4];
+    int len = read_file_data(0, "/t", buf, end - start, start);
+    if (len != end - start)
+        return 0;
+    for (int i = 0; i < len; i++)
+    {
+        if (buf[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+// A new block that ends a run, because it is not next to the one before, is
+// mapped by then: the next run must still pad it, not take it as old
+void test_fresh_block_after_run_break()
+{
+    char data[8292];
+    setup_fragmented_disk(3);
+    memset(data, 'd', sizeof(data));
+    CHECK(write_disk_data(0, "/t", data, sizeof(data), 0) == (int)sizeof(data));
+    file_written(0, sizeof(data));
+    CHECK(write_disk_data(0, "/t", "x", 1, 12288) == 1);
+    file_written(0, 12289);
+    CHECK(reads_zero(8292, 12288));
+}
+
+// Scattered writes of odd sizes over a fragmented bitmap, where reservations
+// come back shorter than asked and runs break often: the file must read back
+// as what was written, with zeros everywhere in between
+void test_writes_over_fragmented_bitmap(int step, int extents)
+{
+    static char expected[24 * BLOCK_SIZE], got[24 * BLOCK_SIZE], data[6 * BLOCK_SIZE];
+    const struct { off_t offset; size_t size; } writes[] = {
+        {100, 5000}, {3 * BLOCK_SIZE + 17, 2 * BLOCK_SIZE}, {9 * BLOCK_SIZE - 5, 6 * BLOCK_SIZE},
+        {20 * BLOCK_SIZE + 1, 1}, {16 * BLOCK_SIZE + 300, 700}, {12 * BLOCK_SIZE, BLOCK_SIZE},
+    };
+    setup_fragmented_disk(step);
+    if (extents)
+        inodes[0].flags |= INODE_EXTENTS;
+    memset(expected, 0, sizeof(expected));
+
+    for (size_t w = 0; w < sizeof(writes) / sizeof(writes[0]); w++)
+    {
+        for (size_t i = 0; i < writes[w].size; i++)
+            data[i] = 'a' + (w * 7 + i) % 26;
+        CHECK(write_disk_data(0, "/t", data, writes[w].size, writes[w].offset) == (int)writes[w].size);
+        file_written(0, writes[w].offset + writes[w].size);
+        memcpy(expected + writes[w].offset, data, writes[w].size);
+    }
+
+    size_t size = inodes[0].size;
+    CHECK(read_file_data(0, "/t", got, size, 0) == (int)size);
+    CHECK(memcmp(got, expected, size) == 0);
+
+    // The writes must really have been split into short runs
+    int start;
+    int run = map_run(0, 9, 6, 0, &start, NULL, NULL, NULL);
+    CHECK(run > 0 && run < 6);
+}
+
+int main(int argc, char *argv[])
+{
+    init_log();
+    init_stats();
+    mount_options.log_level = LVL_ERROR;
+
+    test_tail_run_behind_cursor();
+    test_longer_run_after_wrap();
+    test_full_volume();
+
+    char name[] = "/tmp/alloc_test.XXXXXX";
+    fd_disk = mkstemp(name);
+    if (fd_disk < 0)
+    {
+        perror("alloc_test: Failed to create a scratch disk image");
+        return 1;
+    }
+    unlink(name);
+    init_writeback_cache();
+    init_block_cache(DEFAULT_CACHE_BLOCKS);
+    test_fresh_block_after_run_break();
+    test_writes_over_fragmented_bitmap(2, 0);
+    test_writes_over_fragmented_bitmap(3, 0);
+    test_writes_over_fragmented_bitmap(5, 1);
+    test_writes_over_fragmented_bitmap(3, 1);
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "alloc_test: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("alloc_test: all checks passed\n");
+    return 0;
+}
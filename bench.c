@@ -0,0 +1,239 @@
+/* Micro-benchmarks for the block layer, the block allocator, name lookup and
+   metadata commits. bfs.c is compiled in with its main renamed, so these call
+   its internals directly on the disk image in the current directory, without
+   mounting anything. The image is overwritten: run through make bench, which
+   formats a scratch one. */
+#define main bfs_main
+#include "bfs.c"
+#undef main
+
+#define SAMPLES 20000 // Most samples any benchmark takes
+
+long long samples[SAMPLES];
+
+int compare_samples(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Prints throughput and latency for count timed calls taking elapsed ns in all
+void report(const char *name, int count, long long elapsed)
+{
+    long long total = 0;
+    for (int i = 0; i < count; i++)
+        total += samples[i];
+    qsort(samples, count, sizeof(long long), compare_samples);
+    printf("%-36s %10.0f ops/s  mean=%8.2fus  p50=%8.2fus  p99=%8.2fus  max=%8.2fus\n", name,
+           count / (elapsed / 1e9), total / 1000.0 / count, samples[count / 2] / 1000.0,
+           samples[(int)(count * 0.99)] / 1000.0, samples[count - 1] / 1000.0);
+}
+
+/* Block layer */
+void bench_blocks()
+{
+    char buf[BLOCK_SIZE];
+    int data_blocks = TOTAL_BLOCKS - DATA_BLOCK_START;
+    memset(buf, 0xab, sizeof(buf));
+
+    long long start = stats_begin();
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        long long t = stats_begin();
+        write_block(DATA_BLOCK_START + rand() % data_blocks, buf);
+        samples[i] = stats_begin() - t;
+    }
+    report("write_block (random)", SAMPLES, stats_begin() - start);
+
+    start = stats_begin();
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        long long t = stats_begin();
+        read_block(DATA_BLOCK_START + rand() % data_blocks, buf);
+        samples[i] = stats_begin() - t;
+    }
+    report("read_block (random)", SAMPLES, stats_begin() - start);
+}
+
+/* Allocator */
+
+// Marks every step-th data block used, or none for step 0, and resets the
+// next-fit cursor
+void shape_bitmap(int step)
+{
+    for (int b = DATA_BLOCK_START; b < TOTAL_BLOCKS; b++)
+    {
+        if (step > 0 && (b - DATA_BLOCK_START) % step != 0)
+            bitmap[b / 8] |= (1 << (b % 8));
+        else
+            bitmap[b / 8] &= ~(1 << (b % 8));
+    }
+    free_block_count = count_free_blocks();
+    alloc_cursor = DATA_BLOCK_START / 64;
+}
+
+// Times find_free_block() until a round has taken want blocks, then frees
+// them again, for up to SAMPLES calls
+void bench_find_free_block(const char *name, int step)
+{
+    int taken[TOTAL_BLOCKS];
+    int count = 0;
+    shape_bitmap(step);
+    int want = free_block_count / 2;
+
+    long long start = stats_begin();
+    while (count < SAMPLES)
+    {
+        int n = 0;
+        for (; n < want && count < SAMPLES; n++, count++)
+        {
+            long long t = stats_begin();
+            taken[n] = find_free_block();
+            samples[count] = stats_begin() - t;
+        }
+        for (int i = 0; i < n; i++)
+            release_block(taken[i]);
+        alloc_cursor = DATA_BLOCK_START / 64;
+    }
+    report(name, count, stats_begin() - start);
+}
+
+// Times alloc_blocks() asking for runs of want blocks
+void bench_alloc_blocks(const char *name, int step, int want)
+{
+    int count = 0;
+    shape_bitmap(step);
+    if (free_block_count <= want)
+        return;
+
+    long long start = stats_begin();
+    while (count < SAMPLES)
+    {
+        // Allocate until the volume is nearly full, then start over
+        while (count < SAMPLES && free_block_count > want)
+        {
+            int got;
+            long long t = stats_begin();
+            alloc_blocks(-1, want, &got);
+            samples[count++] = stats_begin() - t;
+        }
+        shape_bitmap(step);
+    }
+    report(name, count, stats_begin() - start);
+}
+
+/* Name lookup */
+
+// Times find_file() with the directory holding files entries, for names that
+// are there and for names that are not
+void bench_find_file(int files)
+{
+    char name[64];
+    memset(directory, 0, sizeof(directory));
+    for (int i = 0; i < files; i++)
+    {
+        snprintf(directory[i].name, FILENAME_LEN, "bench-file-%d", i);
+        directory[i].inode_num = i + 1;
+    }
+    rebuild_name_index();
+
+    long long start = stats_begin();
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        snprintf(name, sizeof(name), "bench-file-%d", i % files);
+        long long t = stats_begin();
+        find_file(name);
+        samples[i] = stats_begin() - t;
+    }
+    snprintf(name, sizeof(name), "find_file hit (%d files)", files);
+    report(name, SAMPLES, stats_begin() - start);
+
+    start = stats_begin();
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        snprintf(name, sizeof(name), "missing-file-%d", i);
+        long long t = stats_begin();
+        find_file(name);
+        samples[i] = stats_begin() - t;
+    }
+    snprintf(name, sizeof(name), "find_file miss (%d files)", files);
+    report(name, SAMPLES, stats_begin() - start);
+
+    memset(directory, 0, sizeof(directory));
+    rebuild_name_index();
+}
+
+/* Metadata commits */
+
+// Times save_metadata() committing dirty inodes and one bitmap byte. Each
+// commit syncs the disk and the journal checkpoints whenever it fills up;
+// both costs are included.
+void bench_save_metadata(int dirty)
+{
+    char name[64];
+    int count = 2000;
+
+    long long start = stats_begin();
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = 0; j < dirty; j++)
+            mark_inode_dirty((i + j) % MAX_FILES);
+        pthread_mutex_lock(&alloc_lock);
+        mark_bitmap_dirty(DATA_BLOCK_START + i % (TOTAL_BLOCKS - DATA_BLOCK_START));
+        pthread_mutex_unlock(&alloc_lock);
+
+        long long t = stats_begin();
+        save_metadata();
+        samples[i] = stats_begin() - t;
+    }
+    snprintf(name, sizeof(name), "save_metadata (%d dirty inodes)", dirty);
+    report(name, count, stats_begin() - start);
+}
+
+int main(int argc, char *argv[])
+{
+    init_log();
+    init_stats();
+    mount_options.log_level = LVL_ERROR;
+    mount_options.cache_blocks = DEFAULT_CACHE_BLOCKS;
+
+    fd_disk = open("disk1", O_RDWR);
+    if (fd_disk < 0)
+    {
+        perror("BENCH ERROR: Failed to open disk file 'disk1'");
+        return 1;
+    }
+    if (open_disk_device() != 0)
+    {
+        fprintf(stderr, "BENCH ERROR: Failed to open the %s disk backend.\n", disk->name);
+        return 1;
+    }
+    initialize_inodes_and_directory();
+    srand(1);
+
+    bench_blocks();
+
+    bench_find_free_block("find_free_block (empty)", 0);
+    bench_find_free_block("find_free_block (every 2nd free)", 2);
+    bench_find_free_block("find_free_block (every 64th free)", 64);
+    bench_alloc_blocks("alloc_blocks x16 (empty)", 0, 16);
+    bench_alloc_blocks("alloc_blocks x16 (every 2nd free)", 2, 16);
+
+    bench_find_file(1);
+    bench_find_file(MAX_FILES / 4);
+    bench_find_file(MAX_FILES / 2);
+    bench_find_file(MAX_FILES);
+
+    // Leave the image consistent for the commits below
+    shape_bitmap(0);
+    bench_save_metadata(1);
+    bench_save_metadata(16);
+    bench_save_metadata(MAX_FILES);
+
+    pthread_mutex_lock(&flush_lock);
+    journal_checkpoint();
+    pthread_mutex_unlock(&flush_lock);
+    close_disk_device();
+    close(fd_disk);
+    return 0;
+}
@@ -1,65 +1,632 @@
 #define FUSE_USE_VERSION 31
+#define _GNU_SOURCE // O_DIRECT
 
 #include <fuse.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE // Defined by <linux/fs.h> via io_uring.h; bfs.h has ours
 #include <errno.h>
 #include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <endian.h>
+#include <pthread.h>
+#include <signal.h>
 
-#define BLOCK_SIZE 4096
-#define MAX_FILES 128
-#define FILENAME_LEN 48
-#define TOTAL_BLOCKS 4096
-#define DIRECT_BLOCKS 8
-#define MAX_FILE_SIZE ((DIRECT_BLOCKS + BLOCK_SIZE / sizeof(int)) * BLOCK_SIZE)
-
-// BFS Disk Layout
-#define SUPERBLOCK 0
-#define BITMAP_BLOCK 1
-#define INODE_TABLE_START 2
-#define INODE_TABLE_BLOCKS 4
-#define ROOT_DIR_BLOCK 6
-#define DATA_BLOCK_START 7
+#include "bfs.h"
 
-typedef struct
-{
-    char name[FILENAME_LEN];
-    int inode_num; // Points to the inode for this file
-} DirectoryEntry;
-
-typedef struct
-{
-    int size; // File size in bytes
-    int block_pointers[DIRECT_BLOCKS];
-    int indirect_pointer; // Pointer to a block containing indirect pointers
-    time_t creation_time;
-    time_t modification_time;
-    mode_t permissions;
-    int ref_count; // Reference count for links
-} Inode;
+#define MAX_FILE_BLOCKS (DIRECT_BLOCKS + PTRS_PER_BLOCK + (long long)PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+#define MAX_FILE_SIZE (MAX_FILE_BLOCKS * BLOCK_SIZE)
+#define DISK_SIZE ((off_t)TOTAL_BLOCKS * BLOCK_SIZE)
 
 int fd_disk;                         // Disk file descriptor
+char *disk_map = NULL;               // The whole disk image when mounted with -o mmap
 char bitmap[BLOCK_SIZE];             // Bitmap to manage free/used blocks
 Inode inodes[MAX_FILES];             // Array of inodes
 DirectoryEntry directory[MAX_FILES]; // Array of directory entries
 char inode_bitmap[MAX_FILES / 8] = {0};
 
+/* Locks. Nested locks are taken in this order: commit_lock, dir_lock, inode_locks[],
+   map_lock, alloc_lock, then meta_lock, open_files_lock, wb_lock, ra_lock or pool_lock. save_metadata()
+   holds only flush_lock while it takes the others one at a time, commit_lock
+   exclusively, so it must not be called with any of them held, and neither
+   must commit_metadata(), which waits on group_lock. A write drops commit_lock
+   before its data IO but keeps the inode locked, so it unlocks the inode
+   before taking commit_lock again. */
+pthread_rwlock_t commit_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP; // Shared while metadata changes
+pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;     // directory[] and the name index
+pthread_rwlock_t inode_locks[MAX_FILES];                    // inodes[i]
+pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;       // Indirect block cache and block map walks
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;     // Both bitmaps and their dirty state
+pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;      // dirty_inodes and dirty_entries
+pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER; // open_files[]
+pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;     // Serializes save_metadata()
+pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;        // Write-back cache index and free list
+
+/* Block device layer: requests are batched and handed to the backend in use */
+#define IO_BATCH 64 // Requests per batch, also the io_uring queue depth
+
+typedef struct
+{
+    int write;           // 1 to write, 0 to read
+    off_t pos;           // Byte offset on disk
+    struct iovec iov[3]; // Buffers, filled or drained in order
+    int iovcnt;
+    size_t size;         // Total bytes over iov
+    int tag;             // Caller's note on what the request is for
+    int result;          // 0 once completed in full, -1 on failure
+} IoRequest;
+
+typedef struct
+{
+    IoRequest reqs[IO_BATCH];
+    int count;
+} IoBatch;
+
+// A run of disk-contiguous blocks mapped for part of a write, see map_write()
+typedef struct
+{
+    int start;      // First disk block
+    size_t len;     // Bytes of the write that go to the run
+    int head_fresh; // First block is new, so zeros go before the data
+    int tail_fresh; // Last block is new, so zeros go after the data
+} WriteRun;
+
+typedef struct
+{
+    const char *name;
+    int (*open)();                             // Called once at mount, 0 on success
+    int (*submit)(IoRequest *reqs, int count); // Runs every request, returns how many failed
+    int (*sync)();                             // Makes completed writes durable
+    void (*close)();
+} BlockDevice;
+
+extern BlockDevice pio_device;
+BlockDevice *disk = &pio_device; // Backend in use
+
+// An io_uring with its submission and completion rings mapped
+typedef struct
+{
+    int fd;
+    unsigned entries;
+    void *sq, *cq;
+    size_t sq_size, cq_size, sqes_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} Ring;
+
+pthread_key_t ring_key; // Per-thread Ring for -o uring
+
+/* Aligned buffer pool: with -o direct the disk image is opened O_DIRECT, and
+   every transfer must cover whole blocks from block-aligned memory */
+#define DIRECT_ALIGN BLOCK_SIZE
+#define POOL_BUFFERS 64
+#define POOL_BUFFER_SIZE (32 * BLOCK_SIZE) // 128 KiB, a full FUSE request
+
+char *pool_memory = NULL;         // POOL_BUFFERS buffers back to back
+void *pool_free[POOL_BUFFERS];    // Buffers not handed out
+int pool_free_count = 0;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Dirty metadata, committed by save_metadata() */
+unsigned char dirty_inodes[MAX_FILES / 8];  // One bit per inode
+unsigned char dirty_entries[MAX_FILES / 8]; // One bit per directory slot
+int bitmap_dirty_start = BLOCK_SIZE;        // Dirty byte range [start, end) of the block bitmap
+int bitmap_dirty_end = 0;
+int inode_bitmap_dirty = 0;
+
+// Tags on checkpoint requests: a directory slot, an inode offset by
+// TAG_INODE, or one of the bitmaps
+#define TAG_INODE MAX_FILES
+#define TAG_BITMAP (2 * MAX_FILES)
+#define TAG_INODE_MAP (2 * MAX_FILES + 1)
+
+/* Metadata journal: save_metadata() stages the dirty metadata as records and
+   appends them to the log as one transaction, and only takes them as
+   committed once they are there. The copies in place stay stale until a
+   checkpoint writes the committed metadata, when the log is full and at
+   unmount. The log then starts over from its first block. Kept under
+   flush_lock. */
+int journal_head = 1;         // Log block the next transaction goes to
+long long journal_seq = 1;    // Sequence number of the next transaction
+char *journal_buf = NULL;     // Transaction being written, JOURNAL_BLOCKS - 1 blocks
+char *journal_stage = NULL;   // Records staged for the commit, grown as needed
+size_t journal_stage_len = 0;
+size_t journal_stage_cap = 0;
+int journal_records = 0;
+int journal_stage_failed = 0; // A record could not be staged, so nothing is committed
+
+// Metadata in the log and which of it is still to be written in place
+char committed_bitmap[BLOCK_SIZE];
+char committed_inode_map[MAX_FILES / 8];
+DirectoryEntry committed_entries[MAX_FILES];
+Inode committed_inodes[MAX_FILES];
+int ckpt_pending = 0;               // Anything committed since the last checkpoint
+int ckpt_bitmap_start = BLOCK_SIZE; // Byte range [start, end) of the block bitmap
+int ckpt_bitmap_end = 0;
+int ckpt_inode_map = 0;
+unsigned char ckpt_entries[MAX_FILES / 8];
+unsigned char ckpt_inodes[MAX_FILES / 8];
+
+/* Group commit: operations ask for a commit with commit_metadata() and wait
+   while the committer thread runs save_metadata() once for every request
+   made before it started. */
+long long commit_requested = 0; // Last request handed out
+long long commit_done = 0;      // Last request covered by a finished commit
+pthread_mutex_t group_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t group_cond = PTHREAD_COND_INITIALIZER; // A request came in, or stop
+pthread_cond_t group_done = PTHREAD_COND_INITIALIZER; // commit_done moved
+pthread_t committer_tid;
+int committer_running = 0;
+int committer_stop = 0;
+
+/* Block allocator state, kept under alloc_lock */
+#define BITMAP_WORDS ((TOTAL_BLOCKS + 63) / 64) // 64-bit words covering the block bitmap
+int alloc_cursor = DATA_BLOCK_START / 64; // Next-fit hint: word the next search starts from
+int free_block_count = 0;                 // Free data blocks, kept in step with the bitmap
+
+/* Name index: hash chains of directory slots, keyed by file name */
+#define NAME_HASH_BUCKETS 256 // Power of two, at least MAX_FILES
+int name_hash_heads[NAME_HASH_BUCKETS]; // First slot in each bucket, -1 if empty
+int name_hash_next[MAX_FILES];          // Next slot in the same bucket, -1 at the end
+
+/* Indirect block cache: direct-mapped by block number, committed by save_metadata() */
+#define INDIRECT_CACHE_SIZE 64
+
+typedef struct
+{
+    int block_num; // Cached block, 0 if the slot is empty
+    int dirty;
+    int ptrs[PTRS_PER_BLOCK];
+} IndirectBlock;
+
+IndirectBlock indirect_cache[INDIRECT_CACHE_SIZE];
+
+/* Indirect block images, kept under map_lock: dirty blocks evicted from the
+   indirect cache before they were committed, blocks staged for the
+   transaction being written, and logged blocks waiting for the checkpoint.
+   A cache miss looks here before reading the disk. */
+#define IMAGE_DIRTY 0  // Not committed yet
+#define IMAGE_STAGED 1 // In the transaction being written
+#define IMAGE_LOGGED 2 // In the log, waiting for the checkpoint
+
+typedef struct BlockImage
+{
+    int block_num;
+    int state; // IMAGE_DIRTY, IMAGE_STAGED or IMAGE_LOGGED
+    struct BlockImage *next;
+    int ptrs[PTRS_PER_BLOCK];
+} BlockImage;
+
+BlockImage *block_images = NULL;
+int *revoked_blocks = NULL; // Indirect blocks freed since the last commit
+int revoked_count = 0;
+int revoked_cap = 0;
+
+/* Blocks reserved for the write being mapped, kept under map_lock */
+int reserved_start = 0;     // Next reserved block
+int reserved_count = 0;     // Reserved blocks not handed out yet
+long long reserve_want = 0; // Data blocks the current map_run() may still allocate
+
+/* Open file table: fi->fh holds the slot index + 1, 0 means no handle */
+#define MAX_OPEN_FILES 256
+
+typedef struct
+{
+    int in_use;
+    int inode_idx; // Inode resolved at open time, -1 once the file is unlinked
+    int pin;       // Inode counted in inode_handles[], kept after unlink
+    int dirty;     // Inode changed through this handle since the last flush
+    off_t ra_next;      // Offset a sequential read would continue from
+    int ra_window;      // Blocks to prefetch next, doubled on each sequential read
+    long long ra_end;   // File block up to which readahead has been queued
+} OpenFile;
+
+OpenFile open_files[MAX_OPEN_FILES];
+
+// A read may hand libfuse buffers that point into the disk image, spliced
+// after the inode is unlocked, so a file unlinked while open keeps its blocks
+// until its last handle is released. Kept under open_files_lock.
+int inode_handles[MAX_FILES];  // Open handles per inode
+int inode_orphaned[MAX_FILES]; // Unlinked with handles open, freed at the last release
+
+/* Block cache: recently read data blocks, split into shards with their own
+   lock and LRU list (-o cache_blocks=N, 0 disables it) */
+#define CACHE_SHARDS 16
+#define DEFAULT_CACHE_BLOCKS 1024 // 4 MiB
+
+typedef struct
+{
+    int block_num; // Cached disk block, 0 if the slot is empty
+    int hash_next; // Next slot in the same bucket, -1 at the end
+    int lru_prev;  // Neighbours in the LRU list, most recently used first
+    int lru_next;
+} CacheSlot;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    int capacity;           // Slots in this shard, 0 if caching is off
+    CacheSlot *slots;
+    char *data;             // BLOCK_SIZE bytes per slot
+    int *buckets;           // One per slot, first slot in each bucket or -1
+    int lru_head, lru_tail; // Most and least recently used slot
+    long hits, misses;
+} CacheShard;
+
+CacheShard block_cache[CACHE_SHARDS];
+
+// A batched read of whole blocks into scratch memory, cached and copied out
+// to the reader once it completes
+typedef struct
+{
+    char *blocks; // Scratch buffer, NULL for reads straight into the caller's buffer
+    int block_num;
+    int count;
+    char *dst;    // Where the wanted bytes go
+    size_t offset; // Offset of the wanted bytes in blocks
+    size_t len;
+} CacheFill;
+
+/* Reads of at least this many bytes are answered with the disk image's file
+   descriptor, so libfuse can splice the data straight to /dev/fuse */
+#define SPLICE_MIN_READ (8 * BLOCK_SIZE)
+
+/* Readahead: sequential reads through a handle queue prefetches of the
+   following file blocks into the block cache for a background thread */
+#define READAHEAD_MIN 4     // Initial window in blocks
+#define READAHEAD_MAX 256   // Largest window (1 MiB)
+#define READAHEAD_QUEUE 64  // Pending prefetches; more are dropped
+
+typedef struct
+{
+    int inode_idx;
+    long long file_block; // First file block to prefetch
+    int count;
+} ReadaheadRequest;
+
+ReadaheadRequest ra_queue[READAHEAD_QUEUE];
+int ra_head = 0;  // Oldest pending request
+int ra_count = 0; // Pending requests
+pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+pthread_t readahead_tid;
+int readahead_running = 0;
+int readahead_stop = 0;
+
+/* Write-back cache: file blocks written with -o writeback stay in memory,
+   without disk blocks, until fsync, release, a full cache or the background
+   flusher writes them out. A page's data is only touched with its inode
+   locked; the index and free list are guarded by wb_lock. */
+#define WRITEBACK_PAGES 256   // Cached blocks (1 MiB)
+#define WRITEBACK_HASH 512    // Index buckets, power of two
+#define WRITEBACK_INTERVAL 5  // Seconds between background flushes
+
+typedef struct
+{
+    int inode_idx;        // Owning inode, -1 if the page is free
+    long long file_block; // File block the page caches
+    int valid_start;      // Written bytes are [valid_start, valid_end)
+    int valid_end;        // 0 until the first write
+    int next;             // Next page in the hash bucket or free list, -1 at the end
+    char data[BLOCK_SIZE];
+} CachePage;
+
+CachePage wb_pages[WRITEBACK_PAGES];
+int wb_hash[WRITEBACK_HASH];   // First page in each bucket, -1 if empty
+int wb_free = -1;              // First free page
+int wb_inode_pages[MAX_FILES]; // Cached pages per inode
+
+pthread_t writeback_tid;
+pthread_cond_t writeback_cond = PTHREAD_COND_INITIALIZER;
+int writeback_running = 0;
+int writeback_stop = 0;
+
+/* Mount options, parsed from -o by fuse_opt_parse() */
+typedef struct
+{
+    int extents;   // Map new files by extents (-o extents)
+    int writeback;    // Buffer writes in memory and allocate blocks at flush time (-o writeback)
+    int cache_blocks; // Capacity of the block cache in blocks (-o cache_blocks=N)
+    int mmap;         // Access the disk image through a shared mapping (-o mmap)
+    int uring;        // Submit disk IO through io_uring (-o uring)
+    int direct;       // Open the disk image with O_DIRECT (-o direct)
+    int log_level;    // Most verbose LVL_* logged (-o log_level=N)
+} MountOptions;
+
+MountOptions mount_options;
+
+/* Logging: the calling thread formats a message into a slot of a ring and
+   the log thread writes the ring out to stderr, so callbacks never wait on
+   stderr. Slots are claimed by a compare-and-swap on log_tail and handed
+   over through their seq, with no lock. When the ring is full a message is
+   dropped and counted, except errors, which are written directly. */
+#define LVL_ERROR 0        // Failures
+#define LVL_INFO 1         // Mount, unmount and journal checkpoints (default)
+#define LVL_DEBUG 2        // Every callback and commit
+#define LOG_SLOTS 4096     // Power of two
+#define LOG_LINE 256       // Bytes of text kept per message
+#define LOG_INTERVAL_MS 20 // How often the log thread drains the ring
+
+typedef struct
+{
+    unsigned long seq;    // Equal to the ring position when free, one more when filled
+    struct timespec time; // When the message was logged
+    int level;
+    pid_t tid;            // Logging thread
+    char text[LOG_LINE];
+} LogSlot;
+
+LogSlot log_slots[LOG_SLOTS];
+unsigned long log_tail = 0;    // Next ring position to claim
+unsigned long log_head = 0;    // Next ring position to write out
+unsigned long log_dropped = 0; // Messages lost to a full ring since the last drain
+pthread_t log_tid;
+int log_running = 0;
+int log_stop = 0;
+
+// Arguments are only evaluated when the level is logged
+#define bfs_log(level, ...)                          \
+    do                                               \
+    {                                                \
+        if ((level) <= mount_options.log_level)      \
+            log_message(level, __VA_ARGS__);         \
+    } while (0)
+
+/* Statistics: every callback and a few internal paths count their calls and
+   record their latency in a log-linear histogram, 8 buckets per power of two
+   nanoseconds (within 12.5%, like an HDR histogram with one significant
+   digit). Each thread records into its own ThreadStats; readers add them up.
+   SIGUSR1 makes the log thread dump them, and they are logged at unmount. */
+enum
+{
+    STAT_GETATTR,
+    STAT_READDIR,
+    STAT_CREATE,
+    STAT_UNLINK,
+    STAT_READ,  // read and read_buf
+    STAT_WRITE, // write and write_buf
+    STAT_OPEN,
+    STAT_RELEASE,
+    STAT_FSYNC,
+    STAT_UTIMENS,
+    STAT_ACCESS,
+    STAT_RENAME,
+    STAT_SAVE_METADATA,
+    STAT_FIND_FILE,
+    STAT_FIND_FREE_BLOCK,
+    STAT_ALLOC_BLOCKS,
+    STAT_OPS
+};
+
+static const char *stat_names[STAT_OPS] = {
+    "getattr", "readdir", "create", "unlink", "read", "write", "open",
+    "release", "fsync", "utimens", "access", "rename", "save_metadata", "find_file", "find_free_block",
+    "alloc_blocks",
+};
+
+#define HIST_SUB 8                          // Buckets per power of two
+#define HIST_BUCKETS (40 * HIST_SUB)        // Up to 2^40 ns (18 minutes)
+
+typedef struct ThreadStats
+{
+    unsigned long long count[STAT_OPS];
+    unsigned long long errors[STAT_OPS];
+    unsigned long long total_ns[STAT_OPS];
+    unsigned long long max_ns[STAT_OPS];
+    unsigned long long hist[STAT_OPS][HIST_BUCKETS];
+    int in_use;               // Owned by a live thread
+    struct ThreadStats *next; // Every ThreadStats ever allocated
+} ThreadStats;
+
+ThreadStats *all_stats = NULL; // Kept, with the in_use flags, under stats_lock
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t stats_key;       // The calling thread's ThreadStats
+int stats_dump_requested = 0; // Set by SIGUSR1
+
+/* Control files: a read-only directory of live counters at /.bfs. A file is
+   rendered when it is opened and its handles hold that text until release,
+   so every read through one handle sees the same snapshot. */
+#define CONTROL_DIR "/.bfs"
+#define CONTROL_HANDLES 32  // Control files open at once
+#define CONTROL_SIZE 8192   // Largest rendered file
+
+typedef struct
+{
+    const char *name;
+    int (*render)(char *out, size_t size); // Returns the length written
+} ControlFile;
+
+char *control_text[CONTROL_HANDLES]; // Rendered text per handle, NULL if the handle is free
+int control_len[CONTROL_HANDLES];
+pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define BFS_OPT(t, p, v) { t, offsetof(MountOptions, p), v }
+
+static const struct fuse_opt bfs_opts[] = {
+    BFS_OPT("extents", extents, 1),
+    BFS_OPT("writeback", writeback, 1),
+    BFS_OPT("cache_blocks=%d", cache_blocks, 0),
+    BFS_OPT("mmap", mmap, 1),
+    BFS_OPT("uring", uring, 1),
+    BFS_OPT("direct", direct, 1),
+    BFS_OPT("log_level=%d", log_level, 0),
+    FUSE_OPT_END
+};
+
 /* Helper Functions */
+void init_log();
+void log_message(int level, const char *fmt, ...);
+int log_format(char *out, size_t size, const LogSlot *slot);
+void log_drain();
+void *log_thread(void *arg);
+void init_stats();
+void release_thread_stats(void *stats);
+long long stats_begin();
+void stats_end(int op, long long start, int failed);
+int hist_bucket(unsigned long long ns);
+unsigned long long hist_value(int bucket);
+int format_stats(char *out, size_t size);
+void dump_stats();
+void request_stats_dump(int sig);
+int render_cache(char *out, size_t size);
+int render_alloc(char *out, size_t size);
+int render_meta(char *out, size_t size);
+int is_control_path(const char *path);
+int find_control_file(const char *path);
+int control_getattr(const char *path, struct stat *stbuf);
+int control_readdir(void *buf, fuse_fill_dir_t filler);
+int control_open(const char *path, struct fuse_file_info *fi);
+int control_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+void control_release(struct fuse_file_info *fi);
 int find_file(const char *name);
+unsigned int name_hash(const char *name);
+void name_index_insert(int entry_idx);
+void name_index_remove(int entry_idx);
+void rebuild_name_index();
 void initialize_inodes_and_directory();
+int pio_submit(IoRequest *reqs, int count);
+int pio_sync();
+int mmap_open();
+int mmap_submit(IoRequest *reqs, int count);
+int mmap_sync();
+void mmap_close();
+Ring *ring_create();
+void ring_destroy(void *arg);
+Ring *thread_ring();
+int uring_open();
+int uring_submit(IoRequest *reqs, int count);
+void uring_close();
+int open_disk_device();
+void close_disk_device();
+int sync_disk();
+int submit_batch(IoBatch *batch);
+void init_buffer_pool();
+void *get_io_buffer(size_t size);
+void put_io_buffer(void *buf);
+int request_aligned(const IoRequest *req);
+int submit_direct(IoRequest *reqs, int count);
+int submit_direct_group(IoRequest *reqs, int count);
+IoRequest *batch_add(IoBatch *batch, int write, off_t pos, const struct iovec *iov, int iovcnt, size_t size, int tag);
+int disk_io(int write, off_t pos, void *buf, size_t size);
 int read_block(int block_num, void *buf);
 int write_block(int block_num, const void *buf);
+int read_blocks(int block_num, int count, void *buf);
+int read_run(int block_num, size_t offset, void *buf, size_t size);
+int write_run(int block_num, size_t offset, const struct iovec *iov, int iovcnt, size_t size);
+int read_packed_records(int start_block, int per_block, void *records, size_t record_size, int count);
+void init_block_cache(int blocks);
+void lru_unlink(CacheShard *shard, int slot);
+void lru_push_front(CacheShard *shard, int slot);
+void lru_push_back(CacheShard *shard, int slot);
+int cache_find(CacheShard *shard, int block_num);
+int cache_get(int block_num, size_t offset, void *buf, size_t size);
+int cache_contains(int block_num);
+void cache_put(int block_num, const void *buf);
+void cache_invalidate(int block_num, int count);
+void cache_stats(long *hits, long *misses);
+int read_cached_run(int block_num, size_t offset, void *buf, size_t size);
+int queue_run_read(IoBatch *batch, CacheFill *fills, int block_num, size_t offset, char *buf, size_t size);
+int finish_reads(IoBatch *batch, CacheFill *fills);
+uint64_t free_bits(int word);
+int count_free_blocks();
 int find_free_block();
+int find_free_run(int want, int *len);
+int alloc_blocks(int goal, int want, int *count);
 void release_block(int block_num);
-void initialize_filesystem();
+void release_blocks(int block_num, int count);
+int take_block(int goal);
 void save_metadata();
+void commit_metadata();
+void *committer_thread(void *arg);
+void begin_change();
+void end_change();
+unsigned int journal_checksum(const char *data, size_t len);
+int journal_add(int type, int target, const void *data, int length);
+int journal_append(const char *data, size_t len, int records);
+void journal_apply(const char *data, size_t len);
+void journal_requeue(const char *data, size_t len);
+void journal_indirect_blocks();
+int journal_commit();
+int journal_checkpoint();
+int checkpoint_images();
+void open_journal();
+int block_revoked(const char *log, const int *starts, int first, int count, int block_num);
+int submit_metadata(IoBatch *batch);
+void queue_metadata(IoBatch *batch, int *writes, int block_num, size_t offset, void *buf, size_t size, int tag);
 int write_partial_block(int block_num, const void *buf, size_t size);
+int write_block_range(int block_num, size_t offset, const void *buf, size_t size);
+void mark_inode_dirty(int inode_idx);
+void mark_entry_dirty(int entry_idx);
+void mark_bitmap_dirty(int block_num);
+int *get_indirect_block(int block_num);
+int init_indirect_block(int block_num);
+void mark_indirect_dirty(int block_num);
+void drop_indirect_block(int block_num);
+BlockImage *find_image(int block_num, int state);
+int stash_image(int block_num, const int *ptrs, int state);
+void free_image(BlockImage *image);
+void revoke_block(int block_num);
+void promote_image(int block_num);
+void unstage_image(int block_num);
+int map_block(int inode_idx, long long file_block, int allocate, int *fresh, int *run);
+int map_run(int inode_idx, long long file_block, long long max_blocks, int allocate, int *start, int *head_fresh, int *tail_fresh, int *pending);
+int extent_list(Inode *inode, Extent **list);
+int map_extent_block(int inode_idx, long long file_block, int allocate, int *fresh, int *run);
+void release_indirect(int block_num, int levels);
+void release_file_blocks(Inode *inode);
 int find_free_inode();
 void release_inode(int inode_num);
+int alloc_open_file(int inode_idx);
+void attach_open_file(int fh, int inode_idx);
+OpenFile *get_open_file(struct fuse_file_info *fi);
+void free_open_file(struct fuse_file_info *fi);
+int invalidate_open_files(int inode_idx);
+void delete_inode(int inode_idx);
+void reclaim_orphan(int inode_idx);
+void reclaim_orphans();
+int lock_inode(const char *path, struct fuse_file_info *fi, int exclusive);
+void unlock_inode(int inode_idx);
+int read_file_data(int inode_idx, const char *path, char *buf, size_t size, off_t offset);
+void free_extent_bufs(struct fuse_bufvec *bv);
+int read_file_extents(int inode_idx, const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset);
+int write_file_data(const char *path, struct fuse_file_info *fi, const char *buf, size_t size, off_t offset);
+int write_file_extents(const char *path, struct fuse_file_info *fi, struct fuse_bufvec *buf, size_t size, off_t offset);
+void file_written(int inode_idx, off_t end);
+void finish_write(const char *path, struct fuse_file_info *fi, int inode_idx, off_t end);
+void note_write(const char *path, struct fuse_file_info *fi);
+int map_write(int inode_idx, const char *path, size_t size, off_t offset, WriteRun **runs, int *count);
+int write_runs(const WriteRun *runs, int count, const char *buf, off_t offset);
+int write_disk_data(int inode_idx, const char *path, const char *buf, size_t size, off_t offset);
+void init_writeback_cache();
+unsigned int wb_bucket(int inode_idx, long long file_block);
+int wb_lookup(int inode_idx, long long file_block);
+int wb_get_page(int inode_idx, long long file_block);
+void wb_free_page(int page);
+int fill_page(int inode_idx, CachePage *page);
+int compare_pages(const void *a, const void *b);
+int flush_inode_pages(int inode_idx, const char *path);
+void drop_inode_pages(int inode_idx);
+int evict_pages(int inode_idx, const char *path);
+int flush_all_pages();
+int cache_write(int inode_idx, const char *path, const char *buf, size_t size, off_t offset);
+void cache_read(int inode_idx, char *buf, size_t size, off_t offset);
+void *writeback_thread(void *arg);
+void plan_readahead(OpenFile *of, int inode_idx, off_t offset, size_t size);
+void queue_readahead(int inode_idx, long long file_block, int count);
+void prefetch_blocks(int block_num, int count);
+void *readahead_thread(void *arg);
 
 /* FUSE Operations */
 int bfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi);
@@ -67,79 +634,224 @@ int bfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 int bfs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
 int bfs_unlink(const char *path);
 int bfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int bfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi);
 int bfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int bfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi);
 int bfs_open(const char *path, struct fuse_file_info *fi);
 int bfs_release(const char *path, struct fuse_file_info *fi);
+int bfs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
 int bfs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi);
 int bfs_access(const char *path, int mask);
-int bfs_rename(const char *oldpath, const char *newpath);
+int bfs_rename(const char *oldpath, const char *newpath, unsigned int flags);
+void *bfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg);
+void bfs_destroy(void *private_data);
+
+// FUSE calls each operation through a timed_ wrapper that records its latency
+#define TIMED_OP(op, stat, params, args)         \
+    int timed_##op params                        \
+    {                                            \
+        long long start = stats_begin();         \
+        int res = bfs_##op args;                 \
+        stats_end(stat, start, res < 0);         \
+        return res;                              \
+    }
+
+TIMED_OP(getattr, STAT_GETATTR, (const char *path, struct stat *stbuf, struct fuse_file_info *fi), (path, stbuf, fi))
+TIMED_OP(readdir, STAT_READDIR,
+         (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+          enum fuse_readdir_flags flags),
+         (path, buf, filler, offset, fi, flags))
+TIMED_OP(create, STAT_CREATE, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+TIMED_OP(unlink, STAT_UNLINK, (const char *path), (path))
+TIMED_OP(read, STAT_READ, (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+         (path, buf, size, offset, fi))
+TIMED_OP(read_buf, STAT_READ,
+         (const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi),
+         (path, bufp, size, offset, fi))
+TIMED_OP(write, STAT_WRITE, (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+         (path, buf, size, offset, fi))
+TIMED_OP(write_buf, STAT_WRITE, (const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi),
+         (path, buf, offset, fi))
+TIMED_OP(open, STAT_OPEN, (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED_OP(release, STAT_RELEASE, (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED_OP(fsync, STAT_FSYNC, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+TIMED_OP(utimens, STAT_UTIMENS, (const char *path, const struct timespec tv[2], struct fuse_file_info *fi),
+         (path, tv, fi))
+TIMED_OP(access, STAT_ACCESS, (const char *path, int mask), (path, mask))
+TIMED_OP(rename, STAT_RENAME, (const char *oldpath, const char *newpath, unsigned int flags), (oldpath, newpath, flags))
 
 static struct fuse_operations bfs_oper = {
-    .getattr = bfs_getattr,
-    .readdir = bfs_readdir,
-    .create = bfs_create,
-    .unlink = bfs_unlink,
-    .read = bfs_read,
-    .write = bfs_write,
-    .open = bfs_open,
-    .release = bfs_release,
-    .utimens = bfs_utimens,
-    .access = bfs_access,
-    .rename = bfs_rename,
+    .getattr = timed_getattr,
+    .readdir = timed_readdir,
+    .create = timed_create,
+    .unlink = timed_unlink,
+    // libfuse calls read_buf and write_buf, which are counted as read and
+    // write; the plain versions are only its fallback
+    .read = timed_read,
+    .read_buf = timed_read_buf,
+    .write = timed_write,
+    .write_buf = timed_write_buf,
+    .open = timed_open,
+    .release = timed_release,
+    .fsync = timed_fsync,
+    .utimens = timed_utimens,
+    .access = timed_access,
+    .rename = timed_rename,
+    .init = bfs_init,
+    .destroy = bfs_destroy,
 };
 
 int find_file(const char *name)
 {
+    long long start = stats_begin();
+    int found = -1; // File not found
+    for (int i = name_hash_heads[name_hash(name)]; i != -1; i = name_hash_next[i])
+    {
+        if (strncmp(directory[i].name, name, FILENAME_LEN) == 0)
+        {
+            found = i;
+            break;
+        }
+    }
+    stats_end(STAT_FIND_FILE, start, 0);
+    return found;
+}
+
+/* Name Index */
+unsigned int name_hash(const char *name)
+{
+    // FNV-1a over at most FILENAME_LEN characters, like the stored names
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < FILENAME_LEN && name[i] != '\0'; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash & (NAME_HASH_BUCKETS - 1);
+}
+
+void name_index_insert(int entry_idx)
+{
+    unsigned int bucket = name_hash(directory[entry_idx].name);
+    name_hash_next[entry_idx] = name_hash_heads[bucket];
+    name_hash_heads[bucket] = entry_idx;
+}
+
+void name_index_remove(int entry_idx)
+{
+    int *link = &name_hash_heads[name_hash(directory[entry_idx].name)];
+    while (*link != -1)
+    {
+        if (*link == entry_idx)
+        {
+            *link = name_hash_next[entry_idx];
+            name_hash_next[entry_idx] = -1;
+            return;
+        }
+        link = &name_hash_next[*link];
+    }
+}
+
+void rebuild_name_index()
+{
+    memset(name_hash_heads, -1, sizeof(name_hash_heads));
+    memset(name_hash_next, -1, sizeof(name_hash_next));
     for (int i = 0; i < MAX_FILES; i++)
     {
-        if (strcmp(directory[i].name, name) == 0)
+        if (directory[i].inode_num > 0)
         {
-            return i;
+            name_index_insert(i);
         }
     }
-    return -1; // File not found
 }
+
 void initialize_inodes_and_directory()
 {
-    fprintf(stderr, "INITIALIZE: Loading metadata from disk...\n");
+    bfs_log(LVL_INFO, "INITIALIZE: Loading metadata from disk...\n");
+
+    for (int i = 0; i < MAX_FILES; i++)
+    {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+
+    // Refuse disks formatted with a different layout
+    char block[BLOCK_SIZE];
+    if (read_block(SUPERBLOCK, block) != 0)
+    {
+        bfs_log(LVL_ERROR, "INITIALIZE ERROR: Failed to load superblock.\n");
+        exit(1);
+    }
+    Superblock *sb = (Superblock *)block;
+    if (sb->magic != BFS_MAGIC || sb->version != BFS_VERSION ||
+        sb->block_size != BLOCK_SIZE || sb->total_blocks != TOTAL_BLOCKS ||
+        sb->inode_count != MAX_FILES || sb->data_block_start != DATA_BLOCK_START)
+    {
+        bfs_log(LVL_ERROR, "INITIALIZE ERROR: Unsupported disk format (version %d, expected %d). Reformat with make_bfs.\n",
+                sb->magic == BFS_MAGIC ? sb->version : 1, BFS_VERSION);
+        exit(1);
+    }
+
+    if (sb->journal_start != JOURNAL_START || sb->journal_blocks != JOURNAL_BLOCKS)
+    {
+        bfs_log(LVL_ERROR, "INITIALIZE ERROR: Unexpected journal location. Reformat with make_bfs.\n");
+        exit(1);
+    }
+    open_journal();
 
     // Load the bitmap
     if (read_block(BITMAP_BLOCK, bitmap) != 0)
     {
-        fprintf(stderr, "INITIALIZE ERROR: Failed to load bitmap.\n");
+        bfs_log(LVL_ERROR, "INITIALIZE ERROR: Failed to load bitmap.\n");
         exit(1);
     }
 
-    // Verify bitmap size is correct (2 blocks of 4 KB each)
+    // Verify bitmap size is correct
     if (sizeof(bitmap) != BLOCK_SIZE)
     {
-        fprintf(stderr, "INITIALIZE ERROR: Bitmap has invalid size.\n");
+        bfs_log(LVL_ERROR, "INITIALIZE ERROR: Bitmap has invalid size.\n");
+        exit(1);
+    }
+    free_block_count = count_free_blocks();
+    alloc_cursor = DATA_BLOCK_START / 64;
+
+    // Load the inode map
+    if (read_block(INODE_MAP_BLOCK, block) != 0)
+    {
+        bfs_log(LVL_ERROR, "INITIALIZE ERROR: Failed to load inode map.\n");
         exit(1);
     }
+    memcpy(inode_bitmap, block, sizeof(inode_bitmap));
 
     // Load the directory
-    if (read_block(ROOT_DIR_BLOCK, directory) != 0)
+    if (read_packed_records(ROOT_DIR_BLOCK, DIR_ENTRIES_PER_BLOCK, directory, sizeof(DirectoryEntry), MAX_FILES) != 0)
     {
-        fprintf(stderr, "INITIALIZE ERROR: Failed to load directory.\n");
+        bfs_log(LVL_ERROR, "INITIALIZE ERROR: Failed to load directory.\n");
         exit(1); // Exit if directory loading fails
     }
+    rebuild_name_index();
+    init_writeback_cache();
+    init_block_cache(mount_options.cache_blocks);
 
     // Load the inode table
-    for (int i = 0; i < MAX_FILES; i++)
+    if (read_packed_records(INODE_TABLE_START, INODES_PER_BLOCK, inodes, sizeof(Inode), MAX_FILES) != 0)
     {
-        // Check if the inode can be read successfully
-        if (read_block(INODE_TABLE_START + i, &inodes[i]) != 0)
-        {
-            fprintf(stderr, "INITIALIZE ERROR: Failed to load inode %d.\n", i);
-            exit(1); // Exit if any inode loading fails
-        }
+        bfs_log(LVL_ERROR, "INITIALIZE ERROR: Failed to load inode table.\n");
+        exit(1); // Exit if inode loading fails
     }
 
-    fprintf(stderr, "INITIALIZE: Metadata loaded successfully.\n");
+    // What is on disk now is what the journal has committed
+    memcpy(committed_bitmap, bitmap, sizeof(bitmap));
+    memcpy(committed_inode_map, inode_bitmap, sizeof(inode_bitmap));
+    memcpy(committed_entries, directory, sizeof(directory));
+    memcpy(committed_inodes, inodes, sizeof(inodes));
+    reclaim_orphans();
+
+    bfs_log(LVL_INFO, "INITIALIZE: Metadata loaded successfully, %d free data blocks.\n", free_block_count);
 }
 
 int find_free_inode()
 {
+    pthread_mutex_lock(&alloc_lock);
     for (int i = 0; i < MAX_FILES; i++)
     {
         int byte_idx = i / 8;
@@ -147,193 +859,3595 @@ int find_free_inode()
         if (!(inode_bitmap[byte_idx] & (1 << bit_idx)))
         {
             inode_bitmap[byte_idx] |= (1 << bit_idx);
+            inode_bitmap_dirty = 1;
+            pthread_mutex_unlock(&alloc_lock);
             return i; // Free inode found
         }
     }
+    pthread_mutex_unlock(&alloc_lock);
     return -1; // No free inode found
 }
 void release_inode(int inode_num)
 {
     int byte_idx = inode_num / 8;
     int bit_idx = inode_num % 8;
+    pthread_mutex_lock(&alloc_lock);
     inode_bitmap[byte_idx] &= ~(1 << bit_idx);
+    inode_bitmap_dirty = 1;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Frees an inode and its blocks. Called inside a change with the inode
+// locked exclusively.
+void delete_inode(int inode_idx)
+{
+    release_file_blocks(&inodes[inode_idx]);
+    memset(&inodes[inode_idx], 0, sizeof(Inode));
+    mark_inode_dirty(inode_idx);
+    release_inode(inode_idx);
+}
+
+// Frees a file unlinked while it was open, once its last handle is released
+void reclaim_orphan(int inode_idx)
+{
+    begin_change();
+    pthread_rwlock_wrlock(&inode_locks[inode_idx]);
+    delete_inode(inode_idx);
+    pthread_rwlock_unlock(&inode_locks[inode_idx]);
+    end_change();
+    commit_metadata();
+    bfs_log(LVL_DEBUG, "RELEASE: Freed unlinked inode %d\n", inode_idx + 1);
+}
+
+// Frees the inodes a crash left allocated with no directory entry, files
+// that were unlinked while open. Runs at mount.
+void reclaim_orphans()
+{
+    unsigned char linked[MAX_FILES / 8] = {0};
+    for (int i = 0; i < MAX_FILES; i++)
+    {
+        int inode_num = directory[i].inode_num;
+        if (inode_num >= 1 && inode_num <= MAX_FILES)
+            linked[(inode_num - 1) / 8] |= 1 << ((inode_num - 1) % 8);
+    }
+
+    int freed = 0;
+    for (int i = 0; i < MAX_FILES; i++)
+    {
+        if ((inode_bitmap[i / 8] & (1 << (i % 8))) && !(linked[i / 8] & (1 << (i % 8))))
+        {
+            delete_inode(i);
+            freed++;
+        }
+    }
+    if (freed > 0)
+    {
+        save_metadata();
+        bfs_log(LVL_INFO, "INITIALIZE: Freed %d inodes unlinked while open.\n", freed);
+    }
 }
 
-int bfs_rename(const char *oldpath, const char *newpath)
+// Renames a file. An existing target is never replaced, so RENAME_NOREPLACE
+// changes nothing; RENAME_EXCHANGE and any other flag are refused.
+int bfs_rename(const char *oldpath, const char *newpath, unsigned int flags)
 {
+    if (flags & ~RENAME_NOREPLACE)
+    {
+        bfs_log(LVL_ERROR, "RENAME ERROR: Unsupported flags %#x\n", flags);
+        return -EINVAL;
+    }
+    if (is_control_path(oldpath) || is_control_path(newpath))
+    {
+        bfs_log(LVL_DEBUG, "RENAME: %s is read-only\n", is_control_path(oldpath) ? oldpath : newpath);
+        return -EROFS;
+    }
+    if (strlen(newpath + 1) >= FILENAME_LEN)
+    {
+        bfs_log(LVL_ERROR, "RENAME ERROR: File name too long: %s\n", newpath);
+        return -ENAMETOOLONG;
+    }
+
+    begin_change();
+    pthread_rwlock_wrlock(&dir_lock);
+
     // Find the file with the old path
     int file_idx = find_file(oldpath + 1); // Remove the leading '/'
     if (file_idx == -1)
     {
-        fprintf(stderr, "RENAME ERROR: File not found: %s\n", oldpath);
+        pthread_rwlock_unlock(&dir_lock);
+        end_change();
+        bfs_log(LVL_DEBUG, "RENAME: File not found: %s\n", oldpath);
         return -ENOENT; // File not found
     }
 
     // Check if the new file path already exists
     if (find_file(newpath + 1) != -1)
     {
-        fprintf(stderr, "RENAME ERROR: File already exists: %s\n", newpath);
+        pthread_rwlock_unlock(&dir_lock);
+        end_change();
+        bfs_log(LVL_DEBUG, "RENAME: File already exists: %s\n", newpath);
         return -EEXIST; // File already exists
     }
 
     // Rename the file by copying the new path to the directory entry
+    name_index_remove(file_idx);
     strncpy(directory[file_idx].name, newpath + 1, FILENAME_LEN);
+    name_index_insert(file_idx);
+    mark_entry_dirty(file_idx);
+    pthread_rwlock_unlock(&dir_lock);
+    end_change();
 
     // Save the updated metadata (directory and inodes)
-    save_metadata();
+    commit_metadata();
 
-    fprintf(stderr, "RENAME: File renamed from %s to %s\n", oldpath, newpath);
+    bfs_log(LVL_DEBUG, "RENAME: File renamed from %s to %s\n", oldpath, newpath);
     return 0; // Success
 }
 
 /* Bitmap Operations */
+
+// Returns the free data blocks among blocks [word * 64, word * 64 + 64) as set
+// bits, bit n standing for block word * 64 + n
+uint64_t free_bits(int word)
+{
+    uint64_t used;
+    memcpy(&used, bitmap + word * 8, sizeof(used));
+    uint64_t free = ~le64toh(used);
+
+    int first = word * 64;
+    if (first + 64 <= DATA_BLOCK_START)
+        return 0;
+    if (first < DATA_BLOCK_START)
+        free &= ~0ULL << (DATA_BLOCK_START - first);
+    if (first + 64 > TOTAL_BLOCKS)
+        free &= ~0ULL >> (first + 64 - TOTAL_BLOCKS);
+    return free;
+}
+
+int count_free_blocks()
+{
+    int count = 0;
+    for (int i = 0; i < BITMAP_WORDS; i++)
+        count += __builtin_popcountll(free_bits(i));
+    return count;
+}
+
+// Allocates the first free block at or after the next-fit cursor, wrapping
+// around once. The bitmap is searched a 64-bit word at a time.
 int find_free_block()
 {
-    for (int i = DATA_BLOCK_START; i < TOTAL_BLOCKS; i++)
+    long long start = stats_begin();
+    int block = -1; // No free block found
+    pthread_mutex_lock(&alloc_lock);
+    for (int n = 0; free_block_count > 0 && n < BITMAP_WORDS; n++)
     {
-        int byte_idx = i / 8;
-        int bit_idx = i % 8;
-        if (!(bitmap[byte_idx] & (1 << bit_idx)))
+        int word = (alloc_cursor + n) % BITMAP_WORDS;
+        uint64_t free = free_bits(word);
+        if (free == 0)
+            continue;
+
+        block = word * 64 + __builtin_ctzll(free);
+        bitmap[block / 8] |= (1 << (block % 8));
+        mark_bitmap_dirty(block);
+        free_block_count--;
+        alloc_cursor = word;
+        break;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    stats_end(STAT_FIND_FREE_BLOCK, start, block == -1);
+    return block;
+}
+
+// Finds the first run of want free blocks at or after the next-fit cursor, or
+// failing that the longest run there is. Runs do not wrap around the end of
+// the volume. Returns the first block and stores the run length in *len.
+int find_free_run(int want, int *len)
+{
+    int best = -1, best_len = 0;
+    int run_start = -1, run_len = 0;
+    for (int n = 0; n < BITMAP_WORDS; n++)
+    {
+        int word = (alloc_cursor + n) % BITMAP_WORDS;
+        if (word == 0)
         {
-            bitmap[byte_idx] |= (1 << bit_idx);
-            write_block(BITMAP_BLOCK, bitmap);
-            return i;
+            // The run that ends the volume may still be the longest
+            if (run_len > best_len)
+            {
+                best = run_start;
+                best_len = run_len;
+            }
+            run_len = 0;
+        }
+
+        uint64_t free = free_bits(word);
+        int bit = 0;
+        while (bit < 64)
+        {
+            if ((free >> bit) & 1)
+            {
+                uint64_t used = ~free >> bit;
+                int span = used == 0 ? 64 - bit : __builtin_ctzll(used);
+                if (run_len == 0)
+                    run_start = word * 64 + bit;
+                run_len += span;
+                bit += span;
+                if (run_len >= want)
+                {
+                    *len = want;
+                    return run_start;
+                }
+            }
+            else
+            {
+                if (run_len > best_len)
+                {
+                    best = run_start;
+                    best_len = run_len;
+                }
+                run_len = 0;
+                uint64_t rest = free >> bit;
+                bit = rest == 0 ? 64 : bit + __builtin_ctzll(rest);
+            }
         }
     }
-    return -1; // No free block found
+    if (run_len > best_len)
+    {
+        best = run_start;
+        best_len = run_len;
+    }
+    *len = best_len;
+    return best;
+}
+
+// Reserves up to want contiguous free blocks with one bitmap update, starting
+// at goal when that block is free. Returns the first block and stores how many
+// were reserved in *count, or returns -1 if the volume is full.
+int alloc_blocks(int goal, int want, int *count)
+{
+    long long stat_start = stats_begin();
+    pthread_mutex_lock(&alloc_lock);
+    if (free_block_count == 0)
+    {
+        pthread_mutex_unlock(&alloc_lock);
+        stats_end(STAT_ALLOC_BLOCKS, stat_start, 1);
+        return -1;
+    }
+
+    int start, len = 0;
+    if (goal >= DATA_BLOCK_START && goal < TOTAL_BLOCKS && !(bitmap[goal / 8] & (1 << (goal % 8))))
+    {
+        start = goal;
+        while (len < want && start + len < TOTAL_BLOCKS &&
+               !(bitmap[(start + len) / 8] & (1 << ((start + len) % 8))))
+            len++;
+    }
+    else
+    {
+        start = find_free_run(want, &len);
+    }
+    if (start < 0 || len == 0)
+    {
+        pthread_mutex_unlock(&alloc_lock);
+        stats_end(STAT_ALLOC_BLOCKS, stat_start, 1);
+        return -1;
+    }
+
+    for (int i = start; i < start + len; i++)
+        bitmap[i / 8] |= (1 << (i % 8));
+    mark_bitmap_dirty(start);
+    mark_bitmap_dirty(start + len - 1);
+    free_block_count -= len;
+    alloc_cursor = (start + len - 1) / 64;
+    pthread_mutex_unlock(&alloc_lock);
+
+    *count = len;
+    stats_end(STAT_ALLOC_BLOCKS, stat_start, 0);
+    return start;
 }
 
 void release_block(int block_num)
 {
     int byte_idx = block_num / 8;
     int bit_idx = block_num % 8;
+    pthread_mutex_lock(&alloc_lock);
+    if (bitmap[byte_idx] & (1 << bit_idx))
+        free_block_count++;
     bitmap[byte_idx] &= ~(1 << bit_idx);
-    write_block(BITMAP_BLOCK, bitmap);
+    mark_bitmap_dirty(block_num);
+    pthread_mutex_unlock(&alloc_lock);
 }
 
-/* Disk IO */
-int read_block(int block_num, void *buf)
+// Frees count consecutive blocks with one bitmap update
+void release_blocks(int block_num, int count)
 {
-    if (lseek(fd_disk, block_num * BLOCK_SIZE, SEEK_SET) == -1)
-        return -1;
-    if (read(fd_disk, buf, BLOCK_SIZE) != BLOCK_SIZE)
-        return -1;
-    return 0;
+    if (count == 0)
+        return;
+
+    pthread_mutex_lock(&alloc_lock);
+    for (int i = block_num; i < block_num + count; i++)
+    {
+        if (bitmap[i / 8] & (1 << (i % 8)))
+            free_block_count++;
+        bitmap[i / 8] &= ~(1 << (i % 8));
+    }
+    mark_bitmap_dirty(block_num);
+    mark_bitmap_dirty(block_num + count - 1);
+    pthread_mutex_unlock(&alloc_lock);
 }
 
-int write_block(int block_num, const void *buf)
+/* Block Mapping: everything here runs under map_lock */
+
+// Returns the cached pointers of an indirect block, loading it on a miss.
+// The result stays valid only until the next cache call.
+int *get_indirect_block(int block_num)
 {
-    if (lseek(fd_disk, block_num * BLOCK_SIZE, SEEK_SET) == -1)
+    IndirectBlock *entry = &indirect_cache[block_num % INDIRECT_CACHE_SIZE];
+    if (entry->block_num == block_num)
+        return entry->ptrs;
+
+    // Dirty blocks are only written in place once committed
+    if (entry->block_num != 0 && entry->dirty)
     {
-        perror("WRITE_BLOCK ERROR: lseek failed");
-        return -1;
+        if (stash_image(entry->block_num, entry->ptrs, IMAGE_DIRTY) != 0)
+            return NULL;
     }
 
-    if (write(fd_disk, buf, BLOCK_SIZE) != BLOCK_SIZE)
+    entry->block_num = 0;
+    entry->dirty = 0;
+    BlockImage *image = find_image(block_num, IMAGE_DIRTY);
+    if (image != NULL)
     {
-        perror("WRITE_BLOCK ERROR: write failed");
-        return -1;
+        memcpy(entry->ptrs, image->ptrs, sizeof(entry->ptrs));
+        free_image(image);
+        entry->dirty = 1;
+    }
+    else if ((image = find_image(block_num, IMAGE_STAGED)) != NULL ||
+             (image = find_image(block_num, IMAGE_LOGGED)) != NULL)
+    {
+        memcpy(entry->ptrs, image->ptrs, sizeof(entry->ptrs));
+    }
+    else if (read_block(block_num, entry->ptrs) != 0)
+    {
+        return NULL;
+    }
+    entry->block_num = block_num;
+    return entry->ptrs;
+}
+
+// Caches a freshly allocated indirect block as all holes without reading it
+int init_indirect_block(int block_num)
+{
+    IndirectBlock *entry = &indirect_cache[block_num % INDIRECT_CACHE_SIZE];
+    if (entry->block_num != 0 && entry->block_num != block_num && entry->dirty)
+    {
+        if (stash_image(entry->block_num, entry->ptrs, IMAGE_DIRTY) != 0)
+            return -1;
     }
 
+    memset(entry->ptrs, 0, sizeof(entry->ptrs));
+    entry->block_num = block_num;
+    entry->dirty = 1;
     return 0;
 }
 
-int write_partial_block(int block_num, const void *buf, size_t size)
+void mark_indirect_dirty(int block_num)
+{
+    IndirectBlock *entry = &indirect_cache[block_num % INDIRECT_CACHE_SIZE];
+    if (entry->block_num == block_num)
+        entry->dirty = 1;
+}
+
+// Forgets an indirect block that is being freed, discarding changes, and
+// revokes its journaled copies so replay can't write them over the block's
+// next user
+void drop_indirect_block(int block_num)
+{
+    IndirectBlock *entry = &indirect_cache[block_num % INDIRECT_CACHE_SIZE];
+    if (entry->block_num == block_num)
+        entry->block_num = 0;
+
+    for (BlockImage *image = block_images; image != NULL;)
+    {
+        BlockImage *next = image->next;
+        if (image->block_num == block_num)
+            free_image(image);
+        image = next;
+    }
+    revoke_block(block_num);
+}
+
+// Records that an indirect block was freed, for the next transaction
+void revoke_block(int block_num)
+{
+    if (revoked_count == revoked_cap)
+    {
+        int cap = revoked_cap > 0 ? revoked_cap * 2 : 64;
+        int *grown = realloc(revoked_blocks, cap * sizeof(int));
+        if (grown == NULL)
+        {
+            bfs_log(LVL_ERROR, "JOURNAL ERROR: Failed to revoke block %d\n", block_num);
+            return;
+        }
+        revoked_blocks = grown;
+        revoked_cap = cap;
+    }
+    revoked_blocks[revoked_count++] = block_num;
+}
+
+BlockImage *find_image(int block_num, int state)
+{
+    for (BlockImage *image = block_images; image != NULL; image = image->next)
+    {
+        if (image->block_num == block_num && image->state == state)
+            return image;
+    }
+    return NULL;
+}
+
+// Keeps a copy of an indirect block, replacing any earlier one in the same
+// state. Returns -1 if memory runs out.
+int stash_image(int block_num, const int *ptrs, int state)
+{
+    BlockImage *image = find_image(block_num, state);
+    if (image == NULL)
+    {
+        image = malloc(sizeof(BlockImage));
+        if (image == NULL)
+        {
+            bfs_log(LVL_ERROR, "JOURNAL ERROR: No memory to keep indirect block %d\n", block_num);
+            return -1;
+        }
+        image->block_num = block_num;
+        image->state = state;
+        image->next = block_images;
+        block_images = image;
+    }
+    memcpy(image->ptrs, ptrs, sizeof(image->ptrs));
+    return 0;
+}
+
+void free_image(BlockImage *image)
+{
+    BlockImage **link = &block_images;
+    while (*link != image)
+        link = &(*link)->next;
+    *link = image->next;
+    free(image);
+}
+
+// Stages the revokes and every dirty indirect block, cached or evicted. The
+// blocks are kept as staged images, which cache misses still find, until the
+// transaction is in the log. Called with flush_lock held and commit_lock held
+// exclusively.
+void journal_indirect_blocks()
+{
+    pthread_mutex_lock(&map_lock);
+    int kept = 0;
+    for (int i = 0; i < revoked_count; i++)
+    {
+        if (journal_add(JREC_REVOKE, revoked_blocks[i], NULL, 0) != 0)
+            revoked_blocks[kept++] = revoked_blocks[i];
+    }
+    revoked_count = kept;
+
+    for (BlockImage *image = block_images; image != NULL; image = image->next)
+    {
+        if (image->state == IMAGE_DIRTY && journal_add(JREC_BLOCK, image->block_num, image->ptrs, BLOCK_SIZE) == 0)
+            image->state = IMAGE_STAGED;
+    }
+
+    for (int i = 0; i < INDIRECT_CACHE_SIZE; i++)
+    {
+        IndirectBlock *entry = &indirect_cache[i];
+        if (entry->block_num == 0 || !entry->dirty)
+            continue;
+        if (journal_add(JREC_BLOCK, entry->block_num, entry->ptrs, BLOCK_SIZE) != 0)
+            continue;
+        if (stash_image(entry->block_num, entry->ptrs, IMAGE_STAGED) != 0)
+        {
+            journal_stage_failed = 1; // Its record has nothing to checkpoint from
+            continue;
+        }
+        entry->dirty = 0;
+    }
+    pthread_mutex_unlock(&map_lock);
+}
+
+// Keeps the staged image of a block now in the log for the checkpoint,
+// replacing any older logged one. Called with map_lock held.
+void promote_image(int block_num)
+{
+    BlockImage *image = find_image(block_num, IMAGE_STAGED);
+    if (image == NULL)
+        return; // Freed since it was staged
+    BlockImage *older = find_image(block_num, IMAGE_LOGGED);
+    if (older != NULL)
+    {
+        memcpy(older->ptrs, image->ptrs, sizeof(older->ptrs));
+        free_image(image);
+        return;
+    }
+    image->state = IMAGE_LOGGED;
+}
+
+// Makes the staged image of a block that did not reach the log dirty again,
+// unless the block was freed or changed since. Called with map_lock held.
+void unstage_image(int block_num)
+{
+    BlockImage *image = find_image(block_num, IMAGE_STAGED);
+    if (image == NULL)
+        return;
+    IndirectBlock *entry = &indirect_cache[block_num % INDIRECT_CACHE_SIZE];
+    if (entry->block_num == block_num)
+    {
+        entry->dirty = 1; // The cached copy is the same or newer
+        free_image(image);
+    }
+    else if (find_image(block_num, IMAGE_DIRTY) != NULL)
+    {
+        free_image(image);
+    }
+    else
+    {
+        image->state = IMAGE_DIRTY;
+    }
+}
+
+// Writes the logged indirect block images in place and frees them.
+// Returns how many failed to write; those are kept for the next checkpoint.
+int checkpoint_images()
+{
+    IoBatch batch;
+    BlockImage *sent[IO_BATCH];
+    int failed = 0;
+    pthread_mutex_lock(&map_lock);
+    BlockImage *image = block_images;
+    for (;;)
+    {
+        batch.count = 0;
+        for (; image != NULL && batch.count < IO_BATCH; image = image->next)
+        {
+            if (image->state != IMAGE_LOGGED)
+                continue;
+            struct iovec iov = {image->ptrs, BLOCK_SIZE};
+            sent[batch.count] = image;
+            batch_add(&batch, 1, (off_t)image->block_num * BLOCK_SIZE, &iov, 1, BLOCK_SIZE, 0);
+        }
+        if (batch.count == 0)
+            break;
+
+        submit_batch(&batch);
+        for (int i = 0; i < batch.count; i++)
+        {
+            if (batch.reqs[i].result == 0)
+            {
+                free_image(sent[i]);
+                continue;
+            }
+            bfs_log(LVL_ERROR, "JOURNAL ERROR: Failed to checkpoint indirect block %d.\n", sent[i]->block_num);
+            failed++;
+        }
+    }
+    pthread_mutex_unlock(&map_lock);
+    return failed;
+}
+
+// Allocates a data block for the write being mapped. Blocks come from a run
+// reserved for the rest of the write, so a multi-block write updates the
+// bitmap once and lands contiguously; a new run is reserved, starting at goal
+// if possible, when the current one is used up. Returns -1 if the volume is full.
+int take_block(int goal)
+{
+    if (reserved_count == 0)
+    {
+        reserved_start = alloc_blocks(goal, reserve_want > 1 ? reserve_want : 1, &reserved_count);
+        if (reserved_start == -1)
+        {
+            reserved_count = 0;
+            return -1;
+        }
+    }
+
+    reserved_count--;
+    return reserved_start++;
+}
+
+// Translates a file block to a disk block through the direct, single- and
+// double-indirect pointers, or through the extents for INODE_EXTENTS files.
+// With allocate set, missing data and indirect blocks are allocated on the
+// way and *fresh (if given) reports whether the data block is new. *run (if
+// given) receives how many blocks from here on are known to be contiguous on
+// disk. Returns the block number, 0 for a hole, or -errno.
+int map_block(int inode_idx, long long file_block, int allocate, int *fresh, int *run)
+{
+    Inode *inode = &inodes[inode_idx];
+    int *ptr;   // Pointer slot for the current level
+    int levels; // Indirect blocks still to walk below *ptr
+
+    if (inode->flags & INODE_EXTENTS)
+        return map_extent_block(inode_idx, file_block, allocate, fresh, run);
+
+    if (fresh != NULL)
+        *fresh = 0;
+    if (run != NULL)
+        *run = 1;
+
+    if (file_block < DIRECT_BLOCKS)
+    {
+        ptr = &inode->block_pointers[file_block];
+        levels = 0;
+    }
+    else if ((file_block -= DIRECT_BLOCKS) < PTRS_PER_BLOCK)
+    {
+        ptr = &inode->indirect_pointer;
+        levels = 1;
+    }
+    else if ((file_block -= PTRS_PER_BLOCK) < (long long)PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+    {
+        ptr = &inode->double_indirect_pointer;
+        levels = 2;
+    }
+    else
+    {
+        return -EFBIG;
+    }
+
+    int parent = 0; // Indirect block holding *ptr, 0 while it is in the inode
+    for (;;)
+    {
+        int block = *ptr;
+        if (block == 0)
+        {
+            if (!allocate)
+                return 0;
+            block = levels > 0 ? find_free_block() : take_block(0);
+            if (block == -1)
+                return -ENOSPC;
+
+            *ptr = block;
+            if (parent == 0)
+                mark_inode_dirty(inode_idx);
+            else
+                mark_indirect_dirty(parent);
+
+            if (levels > 0 && init_indirect_block(block) != 0)
+                return -EIO;
+            if (levels == 0 && fresh != NULL)
+                *fresh = 1;
+        }
+
+        if (levels == 0)
+            return block;
+
+        int *ptrs = get_indirect_block(block);
+        if (ptrs == NULL)
+            return -EIO;
+        levels--;
+        ptr = &ptrs[(levels == 1 ? file_block / PTRS_PER_BLOCK : file_block) % PTRS_PER_BLOCK];
+        parent = block;
+    }
+}
+
+// Maps file blocks starting at file_block for as long as they stay
+// contiguous on disk (or stay holes), up to max_blocks. Stores the first disk
+// block of the run in *start (0 for a hole) and, when allocating, whether the
+// first and last blocks of the run are new. A block allocated past the end of
+// the run stays mapped, so *pending carries whether it is new from one call
+// to the next of the same write; it starts at 0. Returns the run length or
+// -errno.
+int map_run(int inode_idx, long long file_block, long long max_blocks, int allocate, int *start, int *head_fresh, int *tail_fresh, int *pending)
+{
+    int fresh, run;
+    pthread_mutex_lock(&map_lock);
+    reserve_want = allocate ? max_blocks : 0;
+    int block = map_block(inode_idx, file_block, allocate, &fresh, &run);
+    if (block < 0)
+    {
+        release_blocks(reserved_start, reserved_count);
+        reserved_count = 0;
+        pthread_mutex_unlock(&map_lock);
+        return block;
+    }
+
+    *start = block;
+    int head = fresh;
+    if (pending != NULL)
+    {
+        head |= *pending; // Allocated by the previous call
+        *pending = 0;
+    }
+    if (head_fresh != NULL)
+        *head_fresh = head;
+
+    long long len = 0;
+    for (;;)
+    {
+        // Holes are walked one block at a time, mapped blocks a run at a time
+        long long step = block == 0 ? 1 : run;
+        len += step < max_blocks - len ? step : max_blocks - len;
+        if (tail_fresh != NULL)
+            *tail_fresh = len == 1 ? head : fresh;
+        if (len >= max_blocks)
+            break;
+
+        reserve_want = allocate ? max_blocks - len : 0;
+        block = map_block(inode_idx, file_block + len, allocate, &fresh, &run);
+        if (block < 0 || (*start == 0 ? block != 0 : block != *start + len))
+        {
+            if (block > 0 && pending != NULL)
+                *pending = fresh;
+            break; // Errors are reported when the next run starts here
+        }
+    }
+
+    // Hand back whatever the write did not use
+    release_blocks(reserved_start, reserved_count);
+    reserved_count = 0;
+    pthread_mutex_unlock(&map_lock);
+    return len;
+}
+
+// Points *list at the inode's extents and returns how many there are, or -1
+// if the extent block cannot be read. The list lives in the inode or in the
+// indirect cache, so it stays valid only until the next cache call.
+int extent_list(Inode *inode, Extent **list)
+{
+    if (inode->extent_block != 0)
+    {
+        ExtentBlock *eb = (ExtentBlock *)get_indirect_block(inode->extent_block);
+        if (eb == NULL)
+            return -1;
+        *list = eb->extents;
+        return eb->count;
+    }
+
+    int count = 0;
+    while (count < INLINE_EXTENTS && inode->extents[count].length > 0)
+        count++;
+    *list = inode->extents;
+    return count;
+}
+
+// map_block() for INODE_EXTENTS files. New blocks are placed right after
+// the preceding extent when that block is free, so sequential writes grow
+// one extent instead of adding new ones.
+int map_extent_block(int inode_idx, long long file_block, int allocate, int *fresh, int *run)
+{
+    Inode *inode = &inodes[inode_idx];
+    Extent *list;
+
+    if (fresh != NULL)
+        *fresh = 0;
+    if (run != NULL)
+        *run = 1;
+    if (file_block >= MAX_FILE_BLOCKS)
+        return -EFBIG;
+
+    int count = extent_list(inode, &list);
+    if (count < 0)
+        return -EIO;
+
+    // Find the first extent starting after file_block
+    int lo = 0, hi = count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (list[mid].file_block <= file_block)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    Extent *prev = lo > 0 ? &list[lo - 1] : NULL;
+
+    if (prev != NULL && file_block < prev->file_block + prev->length)
+    {
+        int offset = file_block - prev->file_block;
+        if (run != NULL)
+            *run = prev->length - offset;
+        return prev->start_block + offset;
+    }
+    if (!allocate)
+        return 0;
+
+    // Keep the file's disk layout parallel to its logical layout when possible
+    long long goal = prev != NULL ? prev->start_block + (file_block - prev->file_block) : 0;
+    int block = take_block(goal < TOTAL_BLOCKS ? goal : 0);
+    if (block == -1)
+        return -ENOSPC;
+    if (fresh != NULL)
+        *fresh = 1;
+
+    if (prev != NULL && prev->file_block + prev->length == file_block &&
+        prev->start_block + prev->length == block)
+    {
+        prev->length++;
+        if (inode->extent_block != 0)
+            mark_indirect_dirty(inode->extent_block);
+        else
+            mark_inode_dirty(inode_idx);
+        return block;
+    }
+
+    ExtentBlock *eb = NULL;
+    if (inode->extent_block != 0)
+    {
+        eb = (ExtentBlock *)get_indirect_block(inode->extent_block);
+        if (count == EXTENTS_PER_BLOCK)
+        {
+            release_block(block);
+            return -EFBIG; // Too fragmented for one extent block
+        }
+    }
+    else if (count == INLINE_EXTENTS)
+    {
+        // Spill the inline extents into an extent block
+        int eb_num = find_free_block();
+        if (eb_num == -1 || init_indirect_block(eb_num) != 0)
+        {
+            release_block(block);
+            if (eb_num != -1)
+                release_block(eb_num);
+            return eb_num == -1 ? -ENOSPC : -EIO;
+        }
+        eb = (ExtentBlock *)get_indirect_block(eb_num);
+        memcpy(eb->extents, inode->extents, sizeof(inode->extents));
+        eb->count = count;
+        memset(inode->extents, 0, sizeof(inode->extents));
+        inode->extent_block = eb_num;
+        mark_inode_dirty(inode_idx);
+        list = eb->extents;
+    }
+
+    memmove(&list[lo + 1], &list[lo], (count - lo) * sizeof(Extent));
+    list[lo].file_block = file_block;
+    list[lo].start_block = block;
+    list[lo].length = 1;
+
+    if (eb != NULL)
+    {
+        eb->count = count + 1;
+        mark_indirect_dirty(inode->extent_block);
+    }
+    else
+    {
+        mark_inode_dirty(inode_idx);
+    }
+    return block;
+}
+
+// Frees an indirect block and everything it points to, levels deep
+void release_indirect(int block_num, int levels)
+{
+    int ptrs[PTRS_PER_BLOCK];
+    int *cached = get_indirect_block(block_num);
+    if (cached == NULL)
+    {
+        bfs_log(LVL_ERROR, "RELEASE ERROR: Failed to read indirect block %d, leaking its blocks\n", block_num);
+    }
+    else
+    {
+        // Copy out: releasing the next level reuses cache slots
+        memcpy(ptrs, cached, sizeof(ptrs));
+        for (int i = 0; i < PTRS_PER_BLOCK; i++)
+        {
+            if (ptrs[i] == 0)
+                continue;
+            if (levels > 1)
+                release_indirect(ptrs[i], levels - 1);
+            else
+                release_block(ptrs[i]);
+        }
+    }
+
+    drop_indirect_block(block_num);
+    release_block(block_num);
+}
+
+void release_file_blocks(Inode *inode)
+{
+    pthread_mutex_lock(&map_lock);
+    if (inode->flags & INODE_EXTENTS)
+    {
+        Extent *list;
+        int count = extent_list(inode, &list);
+        if (count < 0)
+        {
+            bfs_log(LVL_ERROR, "RELEASE ERROR: Failed to read extent block %d, leaking its blocks\n", inode->extent_block);
+            count = 0;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            for (int j = 0; j < list[i].length; j++)
+                release_block(list[i].start_block + j);
+        }
+        if (inode->extent_block != 0)
+        {
+            drop_indirect_block(inode->extent_block);
+            release_block(inode->extent_block);
+        }
+        pthread_mutex_unlock(&map_lock);
+        return;
+    }
+
+    for (int j = 0; j < DIRECT_BLOCKS; j++)
+    {
+        if (inode->block_pointers[j] != 0)
+        {
+            release_block(inode->block_pointers[j]);
+        }
+    }
+    if (inode->indirect_pointer != 0)
+        release_indirect(inode->indirect_pointer, 1);
+    if (inode->double_indirect_pointer != 0)
+        release_indirect(inode->double_indirect_pointer, 2);
+    pthread_mutex_unlock(&map_lock);
+}
+
+/* Block Device Layer */
+// All disk access goes through the backend chosen at mount: positional
+// preadv/pwritev (the default), a shared mapping of the image (-o mmap) or
+// io_uring (-o uring). Callers queue requests in an IoBatch and submit them
+// together; every request gets its own result.
+
+int pio_submit(IoRequest *reqs, int count)
+{
+    int failed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        IoRequest *req = &reqs[i];
+        ssize_t done = req->write ? pwritev(fd_disk, req->iov, req->iovcnt, req->pos)
+                                  : preadv(fd_disk, req->iov, req->iovcnt, req->pos);
+        req->result = done == (ssize_t)req->size ? 0 : -1;
+        if (req->result != 0)
+        {
+            bfs_log(LVL_ERROR, "DISK IO ERROR: %s failed: %s\n", req->write ? "pwritev" : "preadv", strerror(errno));
+            failed++;
+        }
+    }
+    return failed;
+}
+
+int pio_sync()
+{
+    return fsync(fd_disk);
+}
+
+BlockDevice pio_device = {"pread", NULL, pio_submit, pio_sync, NULL};
+
+// Maps the whole disk image; returns 0 on success, -1 otherwise
+int mmap_open()
+{
+    struct stat st;
+    if (fstat(fd_disk, &st) != 0 || st.st_size < DISK_SIZE)
+    {
+        bfs_log(LVL_ERROR, "MAP_DISK ERROR: Disk image is smaller than %ld bytes.\n", (long)DISK_SIZE);
+        return -1;
+    }
+
+    void *map = mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd_disk, 0);
+    if (map == MAP_FAILED)
+    {
+        bfs_log(LVL_ERROR, "MAP_DISK ERROR: mmap failed: %s\n", strerror(errno));
+        return -1;
+    }
+    disk_map = map;
+    return 0;
+}
+
+int mmap_submit(IoRequest *reqs, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        IoRequest *req = &reqs[i];
+        char *pos = disk_map + req->pos;
+        for (int j = 0; j < req->iovcnt; j++)
+        {
+            if (req->write)
+                memcpy(pos, req->iov[j].iov_base, req->iov[j].iov_len);
+            else
+                memcpy(req->iov[j].iov_base, pos, req->iov[j].iov_len);
+            pos += req->iov[j].iov_len;
+        }
+        req->result = 0;
+    }
+    return 0;
+}
+
+int mmap_sync()
+{
+    if (msync(disk_map, DISK_SIZE, MS_SYNC) != 0)
+        return -1;
+    return fsync(fd_disk);
+}
+
+void mmap_close()
+{
+    msync(disk_map, DISK_SIZE, MS_SYNC);
+    munmap(disk_map, DISK_SIZE);
+    disk_map = NULL;
+}
+
+BlockDevice mmap_device = {"mmap", mmap_open, mmap_submit, mmap_sync, mmap_close};
+
+// Sets up an io_uring with its rings mapped, or returns NULL
+Ring *ring_create()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, IO_BATCH, &params);
+    if (fd < 0)
+        return NULL;
+
+    Ring *ring = calloc(1, sizeof(Ring));
+    if (ring == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq == MAP_FAILED || ring->cq == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        ring_destroy(ring);
+        return NULL;
+    }
+
+    ring->sq_tail = (unsigned *)((char *)ring->sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq + params.cq_off.cqes);
+    return ring;
+}
+
+void ring_destroy(void *arg)
+{
+    Ring *ring = arg;
+    if (ring->sq != NULL && ring->sq != MAP_FAILED)
+        munmap(ring->sq, ring->sq_size);
+    if (ring->cq != NULL && ring->cq != MAP_FAILED)
+        munmap(ring->cq, ring->cq_size);
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    close(ring->fd);
+    free(ring);
+}
+
+// Each thread submits through a ring of its own, created on first use and
+// torn down when the thread exits
+Ring *thread_ring()
+{
+    Ring *ring = pthread_getspecific(ring_key);
+    if (ring == NULL)
+    {
+        ring = ring_create();
+        if (ring != NULL)
+            pthread_setspecific(ring_key, ring);
+    }
+    return ring;
+}
+
+int uring_open()
+{
+    // Make sure the kernel lets us set up rings before committing to them
+    Ring *ring = ring_create();
+    if (ring == NULL)
+    {
+        bfs_log(LVL_ERROR, "URING ERROR: io_uring_setup failed: %s\n", strerror(errno));
+        return -1;
+    }
+    ring_destroy(ring);
+
+    if (pthread_key_create(&ring_key, ring_destroy) != 0)
+        return -1;
+    return 0;
+}
+
+// Queues up to a ring's worth of requests, enters the kernel once to submit
+// them and wait for all of their completions, and repeats for the rest
+int uring_submit(IoRequest *reqs, int count)
+{
+    Ring *ring = thread_ring();
+    if (ring == NULL)
+        return pio_submit(reqs, count);
+
+    int failed = 0;
+    for (int first = 0; first < count; first += ring->entries)
+    {
+        int n = count - first < (int)ring->entries ? count - first : (int)ring->entries;
+        unsigned tail = *ring->sq_tail;
+        unsigned mask = *ring->sq_mask;
+        for (int i = 0; i < n; i++)
+        {
+            IoRequest *req = &reqs[first + i];
+            unsigned idx = tail & mask;
+            struct io_uring_sqe *sqe = &ring->sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = fd_disk;
+            sqe->addr = (unsigned long)req->iov;
+            sqe->len = req->iovcnt;
+            sqe->off = req->pos;
+            sqe->user_data = first + i;
+            ring->sq_array[idx] = idx;
+            req->result = -1;
+            tail++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        int submitted = 0, completed = 0;
+        while (completed < n)
+        {
+            int ret = syscall(__NR_io_uring_enter, ring->fd, n - submitted, n - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0 && errno != EINTR)
+            {
+                // The ring is in an unknown state; drop it and finish synchronously
+                bfs_log(LVL_ERROR, "URING ERROR: io_uring_enter failed: %s\n", strerror(errno));
+                pthread_setspecific(ring_key, NULL);
+                ring_destroy(ring);
+                return failed + pio_submit(reqs + first, count - first);
+            }
+            if (ret > 0)
+                submitted += ret;
+
+            unsigned head = *ring->cq_head;
+            while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+            {
+                struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+                IoRequest *req = &reqs[cqe->user_data];
+                if (cqe->res == (int)req->size)
+                    req->result = 0;
+                else if (cqe->res >= 0)
+                    req->result = pio_submit(req, 1) == 0 ? 0 : -1; // Short transfer, redo it
+                head++;
+                completed++;
+            }
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        for (int i = first; i < first + n; i++)
+        {
+            if (reqs[i].result != 0)
+            {
+                bfs_log(LVL_ERROR, "URING ERROR: %s at offset %ld failed\n", reqs[i].write ? "Write" : "Read", (long)reqs[i].pos);
+                failed++;
+            }
+        }
+    }
+    return failed;
+}
+
+void uring_close()
+{
+    Ring *ring = pthread_getspecific(ring_key);
+    if (ring != NULL)
+    {
+        pthread_setspecific(ring_key, NULL);
+        ring_destroy(ring);
+    }
+}
+
+BlockDevice uring_device = {"io_uring", uring_open, uring_submit, pio_sync, uring_close};
+
+// Selects and opens the backend asked for by the mount options. io_uring
+// falls back to the default backend if the kernel refuses it.
+int open_disk_device()
+{
+    disk = &pio_device;
+    if (mount_options.mmap)
+        disk = &mmap_device;
+    else if (mount_options.uring)
+        disk = &uring_device;
+
+    if (disk->open != NULL && disk->open() != 0)
+    {
+        if (disk != &uring_device)
+            return -1;
+        bfs_log(LVL_INFO, "BFS: io_uring is unavailable, using %s instead.\n", pio_device.name);
+        disk = &pio_device;
+    }
+    return 0;
+}
+
+void close_disk_device()
+{
+    if (disk->close != NULL)
+        disk->close();
+    disk = &pio_device;
+}
+
+// Makes everything written so far durable
+int sync_disk()
+{
+    return disk->sync();
+}
+
+// Submits a batch and leaves the results in its requests for the caller to
+// check before reset. Blocks being written are dropped from the block cache
+// first. Returns the number of failed requests.
+int submit_batch(IoBatch *batch)
+{
+    for (int i = 0; i < batch->count; i++)
+    {
+        IoRequest *req = &batch->reqs[i];
+        if (req->write)
+        {
+            int first = req->pos / BLOCK_SIZE;
+            cache_invalidate(first, (req->pos + req->size + BLOCK_SIZE - 1) / BLOCK_SIZE - first);
+        }
+    }
+    if (batch->count == 0)
+        return 0;
+    if (mount_options.direct)
+        return submit_direct(batch->reqs, batch->count);
+    return disk->submit(batch->reqs, batch->count);
+}
+
+// Appends a request for the buffers in iov, size bytes in total, starting at
+// byte pos on disk. The buffers must stay valid until the batch is submitted.
+IoRequest *batch_add(IoBatch *batch, int write, off_t pos, const struct iovec *iov, int iovcnt, size_t size, int tag)
+{
+    IoRequest *req = &batch->reqs[batch->count++];
+    req->write = write;
+    req->pos = pos;
+    memcpy(req->iov, iov, iovcnt * sizeof(struct iovec));
+    req->iovcnt = iovcnt;
+    req->size = size;
+    req->tag = tag;
+    req->result = 0;
+    return req;
+}
+
+/* Aligned IO for -o direct */
+void init_buffer_pool()
+{
+    if (posix_memalign((void **)&pool_memory, DIRECT_ALIGN, (size_t)POOL_BUFFERS * POOL_BUFFER_SIZE) != 0)
+    {
+        bfs_log(LVL_ERROR, "INITIALIZE ERROR: Failed to allocate the aligned buffer pool.\n");
+        exit(1);
+    }
+    for (int i = 0; i < POOL_BUFFERS; i++)
+        pool_free[i] = pool_memory + (size_t)i * POOL_BUFFER_SIZE;
+    pool_free_count = POOL_BUFFERS;
+}
+
+// Returns a block-aligned buffer of at least size bytes, from the pool when
+// one is free and big enough and from the heap otherwise. Never waits, so
+// callers may hold several at once. Returns NULL if memory runs out.
+void *get_io_buffer(size_t size)
+{
+    if (size <= POOL_BUFFER_SIZE)
+    {
+        void *buf = NULL;
+        pthread_mutex_lock(&pool_lock);
+        if (pool_free_count > 0)
+            buf = pool_free[--pool_free_count];
+        pthread_mutex_unlock(&pool_lock);
+        if (buf != NULL)
+            return buf;
+    }
+
+    void *buf;
+    if (posix_memalign(&buf, DIRECT_ALIGN, (size + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN) != 0)
+        return NULL;
+    return buf;
+}
+
+void put_io_buffer(void *buf)
+{
+    char *p = buf;
+    if (pool_memory != NULL && p >= pool_memory && p < pool_memory + (size_t)POOL_BUFFERS * POOL_BUFFER_SIZE)
+    {
+        pthread_mutex_lock(&pool_lock);
+        pool_free[pool_free_count++] = buf;
+        pthread_mutex_unlock(&pool_lock);
+        return;
+    }
+    free(buf);
+}
+
+// Whether a request can go to an O_DIRECT descriptor as it is
+int request_aligned(const IoRequest *req)
+{
+    if (req->pos % DIRECT_ALIGN != 0 || req->size % DIRECT_ALIGN != 0)
+        return 0;
+    for (int i = 0; i < req->iovcnt; i++)
+    {
+        if ((uintptr_t)req->iov[i].iov_base % DIRECT_ALIGN != 0 || req->iov[i].iov_len % DIRECT_ALIGN != 0)
+            return 0;
+    }
+    return 1;
+}
+
+// Runs a batch on an O_DIRECT descriptor. An unaligned write reads the blocks
+// at its edges before anything in its group is written, so it starts a new
+// group when it shares a block with an earlier request, as when neighbouring
+// inodes are saved together.
+int submit_direct(IoRequest *reqs, int count)
+{
+    int failed = 0;
+    for (int start = 0, end; start < count; start = end)
+    {
+        for (end = start + 1; end < count; end++)
+        {
+            IoRequest *req = &reqs[end];
+            if (!req->write || request_aligned(req))
+                continue;
+            off_t first = req->pos / DIRECT_ALIGN, last = (req->pos + req->size - 1) / DIRECT_ALIGN;
+            int overlap = 0;
+            for (int i = start; i < end && !overlap; i++)
+                overlap = reqs[i].pos / DIRECT_ALIGN <= last && (reqs[i].pos + (off_t)reqs[i].size - 1) / DIRECT_ALIGN >= first;
+            if (overlap)
+                break;
+        }
+        failed += submit_direct_group(&reqs[start], end - start);
+    }
+    return failed;
+}
+
+// Requests that are not aligned are redirected to a pool buffer covering the
+// blocks around them: reads are copied out once they complete, and writes
+// are copied in, after the partial blocks at either end are read so the
+// bytes around the write are kept.
+int submit_direct_group(IoRequest *reqs, int count)
+{
+    IoRequest out[IO_BATCH];          // What goes to the backend
+    int from[IO_BATCH];               // Request each of out[] stands for
+    char *bounce[IO_BATCH] = {NULL};  // Aligned buffer, NULL if not bounced
+    IoRequest edges[2 * IO_BATCH];    // Partial blocks under unaligned writes
+    int edge_of[2 * IO_BATCH];
+    int n = 0, nedges = 0, failed = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        IoRequest *req = &reqs[i];
+        req->result = -1;
+        from[n] = i;
+        out[n] = *req;
+        if (request_aligned(req))
+        {
+            n++;
+            continue;
+        }
+
+        off_t lo = req->pos / DIRECT_ALIGN * DIRECT_ALIGN;
+        off_t hi = (req->pos + req->size + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+        bounce[n] = get_io_buffer(hi - lo);
+        if (bounce[n] == NULL)
+        {
+            bfs_log(LVL_ERROR, "DIRECT IO ERROR: No aligned buffer for %zu bytes\n", (size_t)(hi - lo));
+            failed++;
+            continue;
+        }
+
+        if (req->write && req->pos != lo)
+        {
+            IoRequest *edge = &edges[nedges];
+            edge->write = 0;
+            edge->pos = lo;
+            edge->iov[0].iov_base = bounce[n];
+            edge->iov[0].iov_len = DIRECT_ALIGN;
+            edge->iovcnt = 1;
+            edge->size = DIRECT_ALIGN;
+            edge_of[nedges++] = n;
+        }
+        if (req->write && req->pos + (off_t)req->size != hi && (hi - DIRECT_ALIGN != lo || req->pos == lo))
+        {
+            IoRequest *edge = &edges[nedges];
+            edge->write = 0;
+            edge->pos = hi - DIRECT_ALIGN;
+            edge->iov[0].iov_base = bounce[n] + (hi - DIRECT_ALIGN - lo);
+            edge->iov[0].iov_len = DIRECT_ALIGN;
+            edge->iovcnt = 1;
+            edge->size = DIRECT_ALIGN;
+            edge_of[nedges++] = n;
+        }
+
+        out[n].pos = lo;
+        out[n].iov[0].iov_base = bounce[n];
+        out[n].iov[0].iov_len = hi - lo;
+        out[n].iovcnt = 1;
+        out[n].size = hi - lo;
+        n++;
+    }
+
+    // Fill in the edges of bounced writes, then drop writes that lost theirs
+    if (nedges > 0)
+        disk->submit(edges, nedges);
+    for (int i = 0; i < nedges; i++)
+    {
+        if (edges[i].result != 0)
+            out[edge_of[i]].size = 0;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (out[i].size == 0)
+        {
+            failed++;
+            put_io_buffer(bounce[i]);
+            continue;
+        }
+        if (bounce[i] != NULL && out[i].write)
+        {
+            IoRequest *req = &reqs[from[i]];
+            char *pos = bounce[i] + (req->pos - out[i].pos);
+            for (int j = 0; j < req->iovcnt; j++)
+            {
+                memcpy(pos, req->iov[j].iov_base, req->iov[j].iov_len);
+                pos += req->iov[j].iov_len;
+            }
+        }
+        out[kept] = out[i];
+        from[kept] = from[i];
+        bounce[kept] = bounce[i];
+        kept++;
+    }
+
+    if (kept > 0)
+        failed += disk->submit(out, kept);
+    for (int i = 0; i < kept; i++)
+    {
+        IoRequest *req = &reqs[from[i]];
+        req->result = out[i].result;
+        if (bounce[i] == NULL)
+            continue;
+        if (req->result == 0 && !req->write)
+        {
+            char *pos = bounce[i] + (req->pos - out[i].pos);
+            for (int j = 0; j < req->iovcnt; j++)
+            {
+                memcpy(req->iov[j].iov_base, pos, req->iov[j].iov_len);
+                pos += req->iov[j].iov_len;
+            }
+        }
+        put_io_buffer(bounce[i]);
+    }
+    return failed;
+}
+
+// Performs a single transfer of size bytes at byte pos on disk
+int disk_io(int write, off_t pos, void *buf, size_t size)
+{
+    IoBatch batch;
+    struct iovec iov = {buf, size};
+    batch.count = 0;
+    batch_add(&batch, write, pos, &iov, 1, size, 0);
+    return submit_batch(&batch) == 0 ? 0 : -1;
+}
+
+int read_block(int block_num, void *buf)
+{
+    return disk_io(0, (off_t)block_num * BLOCK_SIZE, buf, BLOCK_SIZE);
+}
+
+// Reads count consecutive blocks with a single request
+int read_blocks(int block_num, int count, void *buf)
+{
+    return disk_io(0, (off_t)block_num * BLOCK_SIZE, buf, (size_t)count * BLOCK_SIZE);
+}
+
+// Reads size bytes starting offset bytes into block_num, running on into the
+// following blocks as needed
+int read_run(int block_num, size_t offset, void *buf, size_t size)
+{
+    return disk_io(0, (off_t)block_num * BLOCK_SIZE + offset, buf, size);
+}
+
+// Writes the buffers in iov, size bytes in total, as one request starting
+// offset bytes into block_num
+int write_run(int block_num, size_t offset, const struct iovec *iov, int iovcnt, size_t size)
+{
+    IoBatch batch;
+    batch.count = 0;
+    batch_add(&batch, 1, (off_t)block_num * BLOCK_SIZE + offset, iov, iovcnt, size, 0);
+    if (submit_batch(&batch) != 0)
+    {
+        bfs_log(LVL_ERROR, "WRITE_RUN ERROR: Failed to write block %d\n", block_num);
+        return -1;
+    }
+    return 0;
+}
+
+// Loads a table of fixed-size records stored per_block to a block
+int read_packed_records(int start_block, int per_block, void *records, size_t record_size, int count)
+{
+    int blocks = (count + per_block - 1) / per_block;
+    char *table = get_io_buffer((size_t)blocks * BLOCK_SIZE);
+    if (table == NULL)
+        return -1;
+
+    if (read_blocks(start_block, blocks, table) != 0)
+    {
+        put_io_buffer(table);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        memcpy((char *)records + i * record_size,
+               table + (size_t)(i / per_block) * BLOCK_SIZE + (i % per_block) * record_size,
+               record_size);
+    }
+    put_io_buffer(table);
+    return 0;
+}
+
+int write_block(int block_num, const void *buf)
+{
+    if (disk_io(1, (off_t)block_num * BLOCK_SIZE, (void *)buf, BLOCK_SIZE) != 0)
+    {
+        bfs_log(LVL_ERROR, "WRITE_BLOCK ERROR: Failed to write block %d\n", block_num);
+        return -1;
+    }
+
+    return 0;
+}
+
+int write_partial_block(int block_num, const void *buf, size_t size)
+{
+    return write_block_range(block_num, 0, buf, size);
+}
+
+int write_block_range(int block_num, size_t offset, const void *buf, size_t size)
+{
+    if (offset + size > BLOCK_SIZE)
+    {
+        bfs_log(LVL_ERROR, "WRITE_BLOCK_RANGE ERROR: Buffer size exceeds block size\n");
+        return -1;
+    }
+
+    if (disk_io(1, (off_t)block_num * BLOCK_SIZE + offset, (void *)buf, size) != 0)
+    {
+        bfs_log(LVL_ERROR, "WRITE_BLOCK_RANGE ERROR: Failed to write block %d\n", block_num);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Block Cache */
+void init_block_cache(int blocks)
+{
+    static int locks_ready = 0;
+    int per_shard = (blocks + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        CacheShard *shard = &block_cache[i];
+        if (!locks_ready)
+            pthread_mutex_init(&shard->lock, NULL);
+
+        // Drop anything left from an earlier mount
+        free(shard->slots);
+        free(shard->data);
+        free(shard->buckets);
+        shard->slots = NULL;
+        shard->data = NULL;
+        shard->buckets = NULL;
+        shard->capacity = 0;
+        shard->hits = shard->misses = 0;
+        if (per_shard == 0)
+            continue;
+
+        shard->slots = calloc(per_shard, sizeof(CacheSlot));
+        shard->data = malloc((size_t)per_shard * BLOCK_SIZE);
+        shard->buckets = malloc(per_shard * sizeof(int));
+        if (shard->slots == NULL || shard->data == NULL || shard->buckets == NULL)
+        {
+            bfs_log(LVL_ERROR, "INITIALIZE ERROR: Failed to allocate %d block cache blocks.\n", blocks);
+            exit(1);
+        }
+
+        // Every slot starts empty on the LRU list, so misses fill them in order
+        shard->capacity = per_shard;
+        shard->lru_head = shard->lru_tail = -1;
+        for (int j = 0; j < per_shard; j++)
+        {
+            shard->buckets[j] = -1;
+            lru_push_back(shard, j);
+        }
+    }
+    locks_ready = 1;
+}
+
+void lru_unlink(CacheShard *shard, int slot)
+{
+    CacheSlot *s = &shard->slots[slot];
+    if (s->lru_prev != -1)
+        shard->slots[s->lru_prev].lru_next = s->lru_next;
+    else
+        shard->lru_head = s->lru_next;
+    if (s->lru_next != -1)
+        shard->slots[s->lru_next].lru_prev = s->lru_prev;
+    else
+        shard->lru_tail = s->lru_prev;
+}
+
+void lru_push_front(CacheShard *shard, int slot)
+{
+    CacheSlot *s = &shard->slots[slot];
+    s->lru_prev = -1;
+    s->lru_next = shard->lru_head;
+    if (shard->lru_head != -1)
+        shard->slots[shard->lru_head].lru_prev = slot;
+    else
+        shard->lru_tail = slot;
+    shard->lru_head = slot;
+}
+
+void lru_push_back(CacheShard *shard, int slot)
+{
+    CacheSlot *s = &shard->slots[slot];
+    s->lru_next = -1;
+    s->lru_prev = shard->lru_tail;
+    if (shard->lru_tail != -1)
+        shard->slots[shard->lru_tail].lru_next = slot;
+    else
+        shard->lru_head = slot;
+    shard->lru_tail = slot;
+}
+
+// Called with the shard locked; returns the slot caching block_num or -1
+int cache_find(CacheShard *shard, int block_num)
+{
+    int bucket = (block_num / CACHE_SHARDS) % shard->capacity;
+    for (int i = shard->buckets[bucket]; i != -1; i = shard->slots[i].hash_next)
+    {
+        if (shard->slots[i].block_num == block_num)
+            return i;
+    }
+    return -1;
+}
+
+// Copies size bytes at offset in a cached block to buf. Returns 1 on a hit
+// and 0 on a miss.
+int cache_get(int block_num, size_t offset, void *buf, size_t size)
+{
+    CacheShard *shard = &block_cache[block_num % CACHE_SHARDS];
+    if (shard->capacity == 0)
+        return 0;
+
+    pthread_mutex_lock(&shard->lock);
+    int slot = cache_find(shard, block_num);
+    if (slot == -1)
+    {
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+
+    memcpy(buf, shard->data + (size_t)slot * BLOCK_SIZE + offset, size);
+    lru_unlink(shard, slot);
+    lru_push_front(shard, slot);
+    shard->hits++;
+    pthread_mutex_unlock(&shard->lock);
+    return 1;
+}
+
+int cache_contains(int block_num)
+{
+    CacheShard *shard = &block_cache[block_num % CACHE_SHARDS];
+    if (shard->capacity == 0)
+        return 0;
+
+    pthread_mutex_lock(&shard->lock);
+    int found = cache_find(shard, block_num) != -1;
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+// Caches a block just read from disk, evicting the least recently used one
+void cache_put(int block_num, const void *buf)
+{
+    CacheShard *shard = &block_cache[block_num % CACHE_SHARDS];
+    if (shard->capacity == 0)
+        return;
+
+    pthread_mutex_lock(&shard->lock);
+    int slot = cache_find(shard, block_num);
+    if (slot == -1)
+    {
+        slot = shard->lru_tail;
+        CacheSlot *s = &shard->slots[slot];
+        if (s->block_num != 0)
+        {
+            int *link = &shard->buckets[(s->block_num / CACHE_SHARDS) % shard->capacity];
+            while (*link != slot)
+                link = &shard->slots[*link].hash_next;
+            *link = s->hash_next;
+        }
+
+        int bucket = (block_num / CACHE_SHARDS) % shard->capacity;
+        s->block_num = block_num;
+        s->hash_next = shard->buckets[bucket];
+        shard->buckets[bucket] = slot;
+    }
+
+    memcpy(shard->data + (size_t)slot * BLOCK_SIZE, buf, BLOCK_SIZE);
+    lru_unlink(shard, slot);
+    lru_push_front(shard, slot);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Drops count blocks from the cache before they are overwritten on disk
+void cache_invalidate(int block_num, int count)
+{
+    for (int b = block_num; b < block_num + count; b++)
+    {
+        CacheShard *shard = &block_cache[b % CACHE_SHARDS];
+        if (shard->capacity == 0)
+            return;
+
+        pthread_mutex_lock(&shard->lock);
+        int slot = cache_find(shard, b);
+        if (slot != -1)
+        {
+            int *link = &shard->buckets[(b / CACHE_SHARDS) % shard->capacity];
+            while (*link != slot)
+                link = &shard->slots[*link].hash_next;
+            *link = shard->slots[slot].hash_next;
+            shard->slots[slot].block_num = 0;
+            lru_unlink(shard, slot);
+            lru_push_back(shard, slot);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void cache_stats(long *hits, long *misses)
+{
+    *hits = *misses = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        pthread_mutex_lock(&block_cache[i].lock);
+        *hits += block_cache[i].hits;
+        *misses += block_cache[i].misses;
+        pthread_mutex_unlock(&block_cache[i].lock);
+    }
+}
+
+// Queues the reads for size bytes starting offset bytes into block_num.
+// Blocks in the block cache are copied out right away and each stretch of
+// missing blocks becomes one request for whole blocks, cached when
+// finish_reads() completes it. Without a cache the bytes are read straight
+// into buf. Returns 0, or -1 if a full batch failed.
+int queue_run_read(IoBatch *batch, CacheFill *fills, int block_num, size_t offset, char *buf, size_t size)
+{
+    if (block_cache[0].capacity == 0)
+    {
+        if (batch->count == IO_BATCH && finish_reads(batch, fills) != 0)
+            return -1;
+        struct iovec iov = {buf, size};
+        fills[batch->count].blocks = NULL;
+        batch_add(batch, 0, (off_t)block_num * BLOCK_SIZE + offset, &iov, 1, size, 0);
+        return 0;
+    }
+
+    size_t done = 0;
+    int block = block_num;
+    while (done < size)
+    {
+        size_t block_offset = done == 0 ? offset : 0;
+        size_t len = BLOCK_SIZE - block_offset < size - done ? BLOCK_SIZE - block_offset : size - done;
+        if (cache_get(block, block_offset, buf + done, len))
+        {
+            done += len;
+            block++;
+            continue;
+        }
+
+        int count = 1;
+        while ((size_t)count * BLOCK_SIZE - block_offset < size - done && !cache_contains(block + count))
+            count++;
+
+        if (batch->count == IO_BATCH && finish_reads(batch, fills) != 0)
+            return -1;
+        CacheFill *fill = &fills[batch->count];
+        fill->blocks = get_io_buffer((size_t)count * BLOCK_SIZE);
+        if (fill->blocks == NULL)
+            return -1;
+        fill->block_num = block;
+        fill->count = count;
+        fill->dst = buf + done;
+        fill->offset = block_offset;
+        fill->len = (size_t)count * BLOCK_SIZE - block_offset;
+        if (fill->len > size - done)
+            fill->len = size - done;
+
+        struct iovec iov = {fill->blocks, (size_t)count * BLOCK_SIZE};
+        batch_add(batch, 0, (off_t)block * BLOCK_SIZE, &iov, 1, iov.iov_len, 0);
+        done += fill->len;
+        block += count;
+    }
+    return 0;
+}
+
+// Submits the queued reads and delivers their blocks. Returns 0 if every
+// read succeeded.
+int finish_reads(IoBatch *batch, CacheFill *fills)
+{
+    int failed = submit_batch(batch);
+    for (int i = 0; i < batch->count; i++)
+    {
+        CacheFill *fill = &fills[i];
+        if (fill->blocks == NULL)
+            continue;
+        if (batch->reqs[i].result == 0)
+        {
+            for (int j = 0; j < fill->count; j++)
+                cache_put(fill->block_num + j, fill->blocks + (size_t)j * BLOCK_SIZE);
+            memcpy(fill->dst, fill->blocks + fill->offset, fill->len);
+        }
+        put_io_buffer(fill->blocks);
+    }
+    batch->count = 0;
+    return failed == 0 ? 0 : -1;
+}
+
+// read_run() through the block cache
+int read_cached_run(int block_num, size_t offset, void *buf, size_t size)
+{
+    IoBatch batch;
+    CacheFill fills[IO_BATCH];
+    batch.count = 0;
+    if (queue_run_read(&batch, fills, block_num, offset, buf, size) != 0)
+    {
+        finish_reads(&batch, fills);
+        return -1;
+    }
+    return finish_reads(&batch, fills);
+}
+
+
+/* Dirty Tracking */
+void mark_inode_dirty(int inode_idx)
+{
+    pthread_mutex_lock(&meta_lock);
+    dirty_inodes[inode_idx / 8] |= (1 << (inode_idx % 8));
+    pthread_mutex_unlock(&meta_lock);
+}
+
+void mark_entry_dirty(int entry_idx)
+{
+    pthread_mutex_lock(&meta_lock);
+    dirty_entries[entry_idx / 8] |= (1 << (entry_idx % 8));
+    pthread_mutex_unlock(&meta_lock);
+}
+
+// Called with alloc_lock held
+void mark_bitmap_dirty(int block_num)
+{
+    int byte_idx = block_num / 8;
+    if (byte_idx < bitmap_dirty_start)
+        bitmap_dirty_start = byte_idx;
+    if (byte_idx + 1 > bitmap_dirty_end)
+        bitmap_dirty_end = byte_idx + 1;
+}
+
+// Submits a batch of checkpoint writes and keeps whatever failed pending for
+// the next checkpoint. Returns how many records were written.
+int submit_metadata(IoBatch *batch)
+{
+    int writes = 0;
+    submit_batch(batch);
+    for (int i = 0; i < batch->count; i++)
+    {
+        IoRequest *req = &batch->reqs[i];
+        int tag = req->tag;
+        if (req->result == 0)
+        {
+            writes++;
+            continue;
+        }
+
+        if (tag == TAG_BITMAP)
+        {
+            int start = req->pos - (off_t)BITMAP_BLOCK * BLOCK_SIZE;
+            bfs_log(LVL_ERROR, "JOURNAL ERROR: Failed to checkpoint block bitmap.\n");
+            if (start < ckpt_bitmap_start)
+                ckpt_bitmap_start = start;
+            if (start + (int)req->size > ckpt_bitmap_end)
+                ckpt_bitmap_end = start + req->size;
+        }
+        else if (tag == TAG_INODE_MAP)
+        {
+            bfs_log(LVL_ERROR, "JOURNAL ERROR: Failed to checkpoint inode bitmap.\n");
+            ckpt_inode_map = 1;
+        }
+        else if (tag >= TAG_INODE)
+        {
+            bfs_log(LVL_ERROR, "JOURNAL ERROR: Failed to checkpoint inode %d.\n", tag - TAG_INODE);
+            ckpt_inodes[(tag - TAG_INODE) / 8] |= 1 << ((tag - TAG_INODE) % 8);
+        }
+        else
+        {
+            bfs_log(LVL_ERROR, "JOURNAL ERROR: Failed to checkpoint directory entry %d.\n", tag);
+            ckpt_entries[tag / 8] |= 1 << (tag % 8);
+        }
+    }
+    batch->count = 0;
+    return writes;
+}
+
+// Adds a metadata write to the batch, submitting it first if it is full
+void queue_metadata(IoBatch *batch, int *writes, int block_num, size_t offset, void *buf, size_t size, int tag)
+{
+    if (batch->count == IO_BATCH)
+        *writes += submit_metadata(batch);
+    struct iovec iov = {buf, size};
+    batch_add(batch, 1, (off_t)block_num * BLOCK_SIZE + offset, &iov, 1, size, tag);
+}
+
+// Metadata changes run between begin_change() and end_change(), so a commit
+// never catches one half done
+void begin_change()
+{
+    pthread_rwlock_rdlock(&commit_lock);
+}
+
+void end_change()
+{
+    pthread_rwlock_unlock(&commit_lock);
+}
+
+// Commits the metadata marked dirty since the last call as one journal
+// transaction. The records are staged with commit_lock held exclusively and
+// written with no lock but flush_lock held. What can't be staged stays dirty,
+// and what fails to reach the log is marked dirty again, for the next call.
+void save_metadata() {
+    long long stat_start = stats_begin();
+    pthread_mutex_lock(&flush_lock);
+    journal_stage_len = 0;
+    journal_records = 0;
+    journal_stage_failed = 0;
+
+    pthread_rwlock_wrlock(&commit_lock);
+    journal_indirect_blocks();
+
+    pthread_mutex_lock(&alloc_lock);
+    int start = bitmap_dirty_start, end = bitmap_dirty_end;
+    if (start < end && journal_add(JREC_BITMAP, start, bitmap + start, end - start) == 0) {
+        bitmap_dirty_start = BLOCK_SIZE;
+        bitmap_dirty_end = 0;
+    }
+    if (inode_bitmap_dirty && journal_add(JREC_INODE_MAP, 0, inode_bitmap, sizeof(inode_bitmap)) == 0)
+        inode_bitmap_dirty = 0;
+    pthread_mutex_unlock(&alloc_lock);
+
+    unsigned char entries[sizeof(dirty_entries)], inodes_to_save[sizeof(dirty_inodes)];
+    pthread_mutex_lock(&meta_lock);
+    memcpy(entries, dirty_entries, sizeof(entries));
+    memcpy(inodes_to_save, dirty_inodes, sizeof(inodes_to_save));
+    memset(dirty_entries, 0, sizeof(dirty_entries));
+    memset(dirty_inodes, 0, sizeof(dirty_inodes));
+    pthread_mutex_unlock(&meta_lock);
+
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!(entries[i / 8] & (1 << (i % 8))))
+            continue;
+        pthread_rwlock_rdlock(&dir_lock);
+        int staged = journal_add(JREC_ENTRY, i, &directory[i], sizeof(DirectoryEntry));
+        pthread_rwlock_unlock(&dir_lock);
+        if (staged != 0)
+            mark_entry_dirty(i);
+    }
+
+    // Inodes only change in a change section, so they hold still without
+    // their locks, which a write keeps while its data goes to disk
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!(inodes_to_save[i / 8] & (1 << (i % 8))))
+            continue;
+        if (journal_add(JREC_INODE, i, &inodes[i], sizeof(Inode)) != 0)
+            mark_inode_dirty(i);
+    }
+    pthread_rwlock_unlock(&commit_lock);
+
+    int records = journal_records;
+    if (journal_stage_failed) {
+        // A transaction missing some of the changes could break the on-disk
+        // invariants, so all of it waits for the next commit
+        bfs_log(LVL_ERROR, "SAVE METADATA ERROR: Failed to stage the commit, %d records wait for the next one.\n", records);
+        journal_requeue(journal_stage, journal_stage_len);
+        records = 0;
+    } else if (records > 0 && journal_commit() != 0) {
+        records = 0;
+    }
+    pthread_mutex_unlock(&flush_lock);
+    stats_end(STAT_SAVE_METADATA, stat_start, 0);
+    if (records > 0)
+        bfs_log(LVL_DEBUG, "SAVE METADATA: Committed %d dirty metadata records.\n", records);
+}
+
+// Commits the metadata changed so far, sharing the commit with any other
+// operation that asks while the committer is idle or busy with an earlier
+// one. Commits directly when there is no committer thread.
+void commit_metadata()
+{
+    pthread_mutex_lock(&group_lock);
+    if (!committer_running)
+    {
+        pthread_mutex_unlock(&group_lock);
+        save_metadata();
+        return;
+    }
+    long long ticket = ++commit_requested;
+    pthread_cond_signal(&group_cond);
+    while (commit_done < ticket)
+        pthread_cond_wait(&group_done, &group_lock);
+    pthread_mutex_unlock(&group_lock);
+}
+
+// Started at mount. Each pass takes every request made so far and commits
+// them together; requests made while it runs wait for the next pass.
+void *committer_thread(void *arg)
+{
+    pthread_mutex_lock(&group_lock);
+    for (;;)
+    {
+        while (commit_done == commit_requested && !committer_stop)
+            pthread_cond_wait(&group_cond, &group_lock);
+        if (commit_done == commit_requested)
+            break;
+
+        long long target = commit_requested;
+        pthread_mutex_unlock(&group_lock);
+        save_metadata();
+        pthread_mutex_lock(&group_lock);
+        if (target - commit_done > 1)
+            bfs_log(LVL_DEBUG, "GROUP COMMIT: One commit for %lld requests.\n", target - commit_done);
+        commit_done = target;
+        pthread_cond_broadcast(&group_done);
+    }
+    pthread_mutex_unlock(&group_lock);
+    return NULL;
+}
+
+
+/* Journal */
+unsigned int journal_checksum(const char *data, size_t len)
+{
+    unsigned int hash = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Stages a record for the transaction being built. Returns -1 if memory runs
+// out, and the caller keeps what the record holds dirty.
+int journal_add(int type, int target, const void *data, int length)
+{
+    size_t need = journal_stage_len + sizeof(JournalRecord) + length;
+    if (need > journal_stage_cap)
+    {
+        size_t cap = journal_stage_cap > 0 ? journal_stage_cap : (size_t)(JOURNAL_BLOCKS - 1) * BLOCK_SIZE;
+        while (cap < need)
+            cap *= 2;
+        char *grown = realloc(journal_stage, cap);
+        if (grown == NULL)
+        {
+            bfs_log(LVL_ERROR, "JOURNAL ERROR: No memory to stage the commit.\n");
+            journal_stage_failed = 1;
+            return -1;
+        }
+        journal_stage = grown;
+        journal_stage_cap = cap;
+    }
+
+    JournalRecord rec = {type, target, length};
+    memcpy(journal_stage + journal_stage_len, &rec, sizeof(rec));
+    if (length > 0)
+        memcpy(journal_stage + journal_stage_len + sizeof(rec), data, length);
+    journal_stage_len = need;
+    journal_records++;
+    return 0;
+}
+
+// Writes the staged records to the log and syncs it, so the commit survives
+// a crash. Records that don't fit in one transaction are split over several,
+// each filling at most the log; the log is checkpointed between them when it
+// is full, and a crash can then leave only the first ones replayed. Each
+// transaction is taken as committed once written. One that fails to write is
+// marked dirty again with the rest. Returns 0 on success.
+int journal_commit()
+{
+    size_t room = (size_t)(JOURNAL_BLOCKS - 1) * BLOCK_SIZE - sizeof(JournalTransaction);
+    size_t pos = 0;
+    int transactions = 0;
+    while (pos < journal_stage_len)
+    {
+        size_t end = pos;
+        int records = 0;
+        while (end < journal_stage_len)
+        {
+            JournalRecord rec;
+            memcpy(&rec, journal_stage + end, sizeof(rec));
+            if (end + sizeof(rec) + rec.length - pos > room)
+                break;
+            end += sizeof(rec) + rec.length;
+            records++;
+        }
+
+        if (journal_append(journal_stage + pos, end - pos, records) != 0)
+        {
+            journal_requeue(journal_stage + pos, journal_stage_len - pos);
+            return -1;
+        }
+        journal_apply(journal_stage + pos, end - pos);
+        pos = end;
+        transactions++;
+    }
+    if (transactions > 1)
+        bfs_log(LVL_INFO, "JOURNAL: Commit too big for the log, split into %d transactions.\n", transactions);
+
+    if (sync_disk() != 0)
+    {
+        bfs_log(LVL_ERROR, "JOURNAL ERROR: fsync failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Writes one transaction holding len bytes of records to the log as one
+// request, checkpointing first if the log has no room left. The checkpoint
+// only writes what earlier transactions put in the log. Returns 0 on success.
+int journal_append(const char *data, size_t len, int records)
+{
+    size_t size = sizeof(JournalTransaction) + len;
+    int blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (journal_head + blocks > JOURNAL_BLOCKS && journal_checkpoint() != 0)
+    {
+        bfs_log(LVL_ERROR, "JOURNAL ERROR: Log full and the checkpoint failed.\n");
+        return -1;
+    }
+
+    JournalTransaction tx;
+    tx.magic = JOURNAL_MAGIC;
+    tx.blocks = blocks;
+    tx.seq = journal_seq;
+    tx.length = len;
+    tx.records = records;
+    tx.checksum = journal_checksum(data, len);
+    memcpy(journal_buf, &tx, sizeof(tx));
+    memcpy(journal_buf + sizeof(tx), data, len);
+    memset(journal_buf + size, 0, (size_t)blocks * BLOCK_SIZE - size);
+
+    if (disk_io(1, (off_t)(JOURNAL_START + journal_head) * BLOCK_SIZE, journal_buf, (size_t)blocks * BLOCK_SIZE) != 0)
+    {
+        bfs_log(LVL_ERROR, "JOURNAL ERROR: Failed to append transaction %lld.\n", journal_seq);
+        return -1;
+    }
+    journal_head += blocks;
+    journal_seq++;
+    return 0;
+}
+
+// Takes the records of a transaction now in the log as committed, for the
+// checkpoint to write in place
+void journal_apply(const char *data, size_t len)
+{
+    pthread_mutex_lock(&map_lock);
+    for (const char *pos = data; pos < data + len;)
+    {
+        JournalRecord rec;
+        memcpy(&rec, pos, sizeof(rec));
+        const char *body = pos + sizeof(rec);
+        pos += sizeof(rec) + rec.length;
+
+        if (rec.type == JREC_BITMAP)
+        {
+            memcpy(committed_bitmap + rec.target, body, rec.length);
+            if (rec.target < ckpt_bitmap_start)
+                ckpt_bitmap_start = rec.target;
+            if (rec.target + rec.length > ckpt_bitmap_end)
+                ckpt_bitmap_end = rec.target + rec.length;
+        }
+        else if (rec.type == JREC_INODE_MAP)
+        {
+            memcpy(committed_inode_map, body, sizeof(committed_inode_map));
+            ckpt_inode_map = 1;
+        }
+        else if (rec.type == JREC_ENTRY)
+        {
+            memcpy(&committed_entries[rec.target], body, sizeof(DirectoryEntry));
+            ckpt_entries[rec.target / 8] |= 1 << (rec.target % 8);
+        }
+        else if (rec.type == JREC_INODE)
+        {
+            memcpy(&committed_inodes[rec.target], body, sizeof(Inode));
+            ckpt_inodes[rec.target / 8] |= 1 << (rec.target % 8);
+        }
+        else if (rec.type == JREC_BLOCK)
+        {
+            promote_image(rec.target);
+        }
+    }
+    pthread_mutex_unlock(&map_lock);
+    ckpt_pending = 1;
+}
+
+// Marks what staged records hold dirty again when they did not reach the log
+void journal_requeue(const char *data, size_t len)
+{
+    for (const char *pos = data; pos < data + len;)
+    {
+        JournalRecord rec;
+        memcpy(&rec, pos, sizeof(rec));
+        pos += sizeof(rec) + rec.length;
+
+        if (rec.type == JREC_BITMAP || rec.type == JREC_INODE_MAP)
+        {
+            pthread_mutex_lock(&alloc_lock);
+            if (rec.type == JREC_INODE_MAP)
+                inode_bitmap_dirty = 1;
+            else if (rec.length > 0)
+            {
+                mark_bitmap_dirty(rec.target * 8);
+                mark_bitmap_dirty((rec.target + rec.length - 1) * 8);
+            }
+            pthread_mutex_unlock(&alloc_lock);
+        }
+        else if (rec.type == JREC_ENTRY)
+        {
+            mark_entry_dirty(rec.target);
+        }
+        else if (rec.type == JREC_INODE)
+        {
+            mark_inode_dirty(rec.target);
+        }
+        else
+        {
+            pthread_mutex_lock(&map_lock);
+            if (rec.type == JREC_BLOCK)
+                unstage_image(rec.target);
+            else
+                revoke_block(rec.target);
+            pthread_mutex_unlock(&map_lock);
+        }
+    }
+}
+
+// Writes all committed metadata in place and empties the log. The log is
+// made durable first, so a crash part way through replays it, and the
+// metadata before the log is reset. Called with flush_lock held.
+int journal_checkpoint()
+{
+    IoBatch batch;
+    int writes = 0, queued = 0;
+    batch.count = 0;
+    if (!ckpt_pending)
+        return 0;
+    if (sync_disk() != 0)
+    {
+        bfs_log(LVL_ERROR, "JOURNAL ERROR: fsync failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (ckpt_bitmap_start < ckpt_bitmap_end)
+    {
+        queue_metadata(&batch, &writes, BITMAP_BLOCK, ckpt_bitmap_start, committed_bitmap + ckpt_bitmap_start,
+                       ckpt_bitmap_end - ckpt_bitmap_start, TAG_BITMAP);
+        queued++;
+    }
+    if (ckpt_inode_map)
+    {
+        queue_metadata(&batch, &writes, INODE_MAP_BLOCK, 0, committed_inode_map, sizeof(committed_inode_map), TAG_INODE_MAP);
+        queued++;
+    }
+    for (int i = 0; i < MAX_FILES; i++)
+    {
+        if (ckpt_entries[i / 8] & (1 << (i % 8)))
+        {
+            queue_metadata(&batch, &writes, ROOT_DIR_BLOCK + i / DIR_ENTRIES_PER_BLOCK,
+                           (i % DIR_ENTRIES_PER_BLOCK) * sizeof(DirectoryEntry),
+                           &committed_entries[i], sizeof(DirectoryEntry), i);
+            queued++;
+        }
+        if (ckpt_inodes[i / 8] & (1 << (i % 8)))
+        {
+            queue_metadata(&batch, &writes, INODE_TABLE_START + i / INODES_PER_BLOCK,
+                           (i % INODES_PER_BLOCK) * sizeof(Inode),
+                           &committed_inodes[i], sizeof(Inode), TAG_INODE + i);
+            queued++;
+        }
+    }
+    ckpt_bitmap_start = BLOCK_SIZE;
+    ckpt_bitmap_end = 0;
+    ckpt_inode_map = 0;
+    memset(ckpt_entries, 0, sizeof(ckpt_entries));
+    memset(ckpt_inodes, 0, sizeof(ckpt_inodes));
+
+    writes += submit_metadata(&batch);
+    int failed = queued - writes + checkpoint_images();
+    if (failed > 0)
+    {
+        bfs_log(LVL_ERROR, "JOURNAL ERROR: %d records failed to checkpoint, keeping the log.\n", failed);
+        return -1;
+    }
+    if (sync_disk() != 0)
+    {
+        bfs_log(LVL_ERROR, "JOURNAL ERROR: fsync failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    char block[BLOCK_SIZE] = {0};
+    JournalHeader header = {JOURNAL_MAGIC, 1, journal_seq};
+    memcpy(block, &header, sizeof(header));
+    if (write_block(JOURNAL_START, block) != 0 || sync_disk() != 0)
+    {
+        bfs_log(LVL_ERROR, "JOURNAL ERROR: Failed to reset the log.\n");
+        return -1;
+    }
+    journal_head = 1;
+    ckpt_pending = 0;
+    bfs_log(LVL_INFO, "JOURNAL: Checkpointed %d metadata records.\n", writes);
+    return 0;
+}
+
+// Whether a block is revoked by any of transactions [first, count)
+int block_revoked(const char *log, const int *starts, int first, int count, int block_num)
+{
+    for (int k = first; k < count; k++)
+    {
+        const char *pos = log + (size_t)starts[k] * BLOCK_SIZE;
+        JournalTransaction tx;
+        memcpy(&tx, pos, sizeof(tx));
+        const char *rec_pos = pos + sizeof(tx);
+        for (int r = 0; r < tx.records; r++)
+        {
+            JournalRecord rec;
+            memcpy(&rec, rec_pos, sizeof(rec));
+            if (rec.type == JREC_REVOKE && rec.target == block_num)
+                return 1;
+            rec_pos += sizeof(rec) + rec.length;
+        }
+    }
+    return 0;
+}
+
+// Replays the transactions a crash left in the log, writing their records in
+// place, then empties the log and readies it for new transactions. Runs at
+// mount before any metadata is loaded.
+void open_journal()
+{
+    journal_buf = get_io_buffer((size_t)(JOURNAL_BLOCKS - 1) * BLOCK_SIZE);
+    char *log = get_io_buffer((size_t)JOURNAL_BLOCKS * BLOCK_SIZE);
+    if (journal_buf == NULL || log == NULL || read_blocks(JOURNAL_START, JOURNAL_BLOCKS, log) != 0)
+    {
+        bfs_log(LVL_ERROR, "INITIALIZE ERROR: Failed to load the journal.\n");
+        exit(1);
+    }
+
+    JournalHeader header;
+    memcpy(&header, log, sizeof(header));
+    if (header.magic != JOURNAL_MAGIC || header.tail < 1 || header.tail >= JOURNAL_BLOCKS)
+    {
+        bfs_log(LVL_ERROR, "INITIALIZE ERROR: Journal header is corrupt.\n");
+        exit(1);
+    }
+
+    // The log ends at the first block that does not hold the next complete
+    // transaction in sequence
+    int starts[JOURNAL_BLOCKS];
+    int count = 0;
+    long long seq = header.seq;
+    for (int pos = header.tail; pos < JOURNAL_BLOCKS;)
+    {
+        JournalTransaction tx;
+        memcpy(&tx, log + (size_t)pos * BLOCK_SIZE, sizeof(tx));
+        if (tx.magic != JOURNAL_MAGIC || tx.seq != seq || tx.blocks < 1 || pos + tx.blocks > JOURNAL_BLOCKS ||
+            tx.length < 0 || sizeof(tx) + tx.length > (size_t)tx.blocks * BLOCK_SIZE ||
+            journal_checksum(log + (size_t)pos * BLOCK_SIZE + sizeof(tx), tx.length) != tx.checksum)
+            break;
+        starts[count++] = pos;
+        pos += tx.blocks;
+        seq++;
+    }
+
+    for (int k = 0; k < count; k++)
+    {
+        JournalTransaction tx;
+        memcpy(&tx, log + (size_t)starts[k] * BLOCK_SIZE, sizeof(tx));
+        char *rec_pos = log + (size_t)starts[k] * BLOCK_SIZE + sizeof(tx);
+        for (int r = 0; r < tx.records; r++)
+        {
+            JournalRecord rec;
+            memcpy(&rec, rec_pos, sizeof(rec));
+            char *data = rec_pos + sizeof(rec);
+            rec_pos += sizeof(rec) + rec.length;
+
+            off_t pos = -1;
+            if (rec.type == JREC_BITMAP && rec.target >= 0 && rec.target + rec.length <= BLOCK_SIZE)
+                pos = (off_t)BITMAP_BLOCK * BLOCK_SIZE + rec.target;
+            else if (rec.type == JREC_INODE_MAP && rec.length == sizeof(inode_bitmap))
+                pos = (off_t)INODE_MAP_BLOCK * BLOCK_SIZE;
+            else if (rec.type == JREC_ENTRY && rec.target >= 0 && rec.target < MAX_FILES && rec.length == sizeof(DirectoryEntry))
+                pos = (off_t)(ROOT_DIR_BLOCK + rec.target / DIR_ENTRIES_PER_BLOCK) * BLOCK_SIZE +
+                      (rec.target % DIR_ENTRIES_PER_BLOCK) * sizeof(DirectoryEntry);
+            else if (rec.type == JREC_INODE && rec.target >= 0 && rec.target < MAX_FILES && rec.length == sizeof(Inode))
+                pos = (off_t)(INODE_TABLE_START + rec.target / INODES_PER_BLOCK) * BLOCK_SIZE +
+                      (rec.target % INODES_PER_BLOCK) * sizeof(Inode);
+            else if (rec.type == JREC_BLOCK && rec.target >= DATA_BLOCK_START && rec.target < TOTAL_BLOCKS &&
+                     rec.length == BLOCK_SIZE && !block_revoked(log, starts, k + 1, count, rec.target))
+                pos = (off_t)rec.target * BLOCK_SIZE;
+            if (pos == -1)
+                continue;
+
+            if (disk_io(1, pos, data, rec.length) != 0)
+            {
+                bfs_log(LVL_ERROR, "INITIALIZE ERROR: Failed to replay the journal.\n");
+                exit(1);
+            }
+        }
+    }
+
+    journal_seq = seq;
+    journal_head = 1;
+    if (count > 0)
+    {
+        memset(log, 0, BLOCK_SIZE);
+        header.tail = 1;
+        header.seq = seq;
+        memcpy(log, &header, sizeof(header));
+        if (sync_disk() != 0 || write_block(JOURNAL_START, log) != 0 || sync_disk() != 0)
+        {
+            bfs_log(LVL_ERROR, "INITIALIZE ERROR: Failed to reset the journal.\n");
+            exit(1);
+        }
+        bfs_log(LVL_INFO, "INITIALIZE: Replayed %d journal transactions.\n", count);
+    }
+    put_io_buffer(log);
+}
+
+
+/* Open File Table */
+// Takes a free slot for the inode, or for one attached later with
+// attach_open_file() when inode_idx is -1. Returns the handle, or -1 if the
+// table is full.
+int alloc_open_file(int inode_idx)
+{
+    pthread_mutex_lock(&open_files_lock);
+    for (int i = 0; i < MAX_OPEN_FILES; i++)
+    {
+        if (!open_files[i].in_use)
+        {
+            open_files[i].in_use = 1;
+            open_files[i].inode_idx = inode_idx;
+            open_files[i].pin = inode_idx;
+            if (inode_idx != -1)
+                inode_handles[inode_idx]++;
+            open_files[i].dirty = 0;
+            open_files[i].ra_next = 0;
+            open_files[i].ra_window = READAHEAD_MIN;
+            open_files[i].ra_end = 0;
+            pthread_mutex_unlock(&open_files_lock);
+            return i + 1;
+        }
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return -1; // Too many open files
+}
+
+void attach_open_file(int fh, int inode_idx)
+{
+    pthread_mutex_lock(&open_files_lock);
+    open_files[fh - 1].inode_idx = inode_idx;
+    open_files[fh - 1].pin = inode_idx;
+    inode_handles[inode_idx]++;
+    pthread_mutex_unlock(&open_files_lock);
+}
+
+// The slot stays put until release, but its fields are read and written
+// under open_files_lock.
+OpenFile *get_open_file(struct fuse_file_info *fi)
+{
+    if (fi == NULL || fi->fh == 0 || fi->fh > MAX_OPEN_FILES)
+        return NULL;
+    return &open_files[fi->fh - 1];
+}
+
+// Frees a handle, and the inode behind it if it was the last handle of an
+// unlinked file. Called with no locks held.
+void free_open_file(struct fuse_file_info *fi)
+{
+    OpenFile *of = get_open_file(fi);
+    if (of != NULL)
+    {
+        pthread_mutex_lock(&open_files_lock);
+        int pin = of->pin;
+        of->in_use = 0;
+        int orphan = pin != -1 && --inode_handles[pin] == 0 && inode_orphaned[pin];
+        if (orphan)
+            inode_orphaned[pin] = 0;
+        pthread_mutex_unlock(&open_files_lock);
+        fi->fh = 0;
+        if (orphan)
+            reclaim_orphan(pin);
+    }
+}
+
+// Detaches every handle from an inode that is being unlinked. Returns 1 if
+// any are open; the inode is then left for the last release to free.
+int invalidate_open_files(int inode_idx)
+{
+    pthread_mutex_lock(&open_files_lock);
+    for (int i = 0; i < MAX_OPEN_FILES; i++)
+    {
+        if (open_files[i].in_use && open_files[i].inode_idx == inode_idx)
+            open_files[i].inode_idx = -1;
+    }
+    int open = inode_handles[inode_idx] > 0;
+    inode_orphaned[inode_idx] = open;
+    pthread_mutex_unlock(&open_files_lock);
+    return open;
+}
+
+// Resolves the 0-based inode for a callback, from its open handle when it has
+// one and by name otherwise, and locks it shared or exclusive. Returns -1 if
+// the file does not exist. Unlink frees an inode only while holding its lock
+// exclusively, so a locked inode stays valid until unlock_inode().
+int lock_inode(const char *path, struct fuse_file_info *fi, int exclusive)
+{
+    int inode_idx;
+    OpenFile *of = get_open_file(fi);
+    if (of != NULL)
+    {
+        pthread_mutex_lock(&open_files_lock);
+        inode_idx = of->inode_idx;
+        pthread_mutex_unlock(&open_files_lock);
+        if (inode_idx == -1)
+            return -1;
+    }
+    else
+    {
+        pthread_rwlock_rdlock(&dir_lock);
+        int file_idx = find_file(path + 1);
+        if (file_idx == -1)
+        {
+            pthread_rwlock_unlock(&dir_lock);
+            return -1;
+        }
+        inode_idx = directory[file_idx].inode_num - 1;
+    }
+
+    if (exclusive)
+        pthread_rwlock_wrlock(&inode_locks[inode_idx]);
+    else
+        pthread_rwlock_rdlock(&inode_locks[inode_idx]);
+
+    if (of == NULL)
+    {
+        pthread_rwlock_unlock(&dir_lock);
+        return inode_idx;
+    }
+
+    // The file may have been unlinked before we got the lock
+    pthread_mutex_lock(&open_files_lock);
+    int valid = of->inode_idx == inode_idx;
+    pthread_mutex_unlock(&open_files_lock);
+    if (!valid)
+    {
+        pthread_rwlock_unlock(&inode_locks[inode_idx]);
+        return -1;
+    }
+    return inode_idx;
+}
+
+void unlock_inode(int inode_idx)
+{
+    pthread_rwlock_unlock(&inode_locks[inode_idx]);
+}
+
+
+/* Write-back Cache */
+void init_writeback_cache()
+{
+    memset(wb_hash, -1, sizeof(wb_hash));
+    memset(wb_inode_pages, 0, sizeof(wb_inode_pages));
+    wb_free = -1;
+    for (int i = WRITEBACK_PAGES - 1; i >= 0; i--)
+    {
+        wb_pages[i].inode_idx = -1;
+        wb_pages[i].next = wb_free;
+        wb_free = i;
+    }
+}
+
+unsigned int wb_bucket(int inode_idx, long long file_block)
+{
+    return ((unsigned int)inode_idx * 2654435761u ^ (unsigned int)file_block) & (WRITEBACK_HASH - 1);
+}
+
+// Called with wb_lock held
+int wb_lookup(int inode_idx, long long file_block)
+{
+    for (int i = wb_hash[wb_bucket(inode_idx, file_block)]; i != -1; i = wb_pages[i].next)
+    {
+        if (wb_pages[i].inode_idx == inode_idx && wb_pages[i].file_block == file_block)
+            return i;
+    }
+    return -1;
+}
+
+// Returns the page caching a file block, taking a free one if there is none
+// yet, or -1 if the cache is full
+int wb_get_page(int inode_idx, long long file_block)
+{
+    pthread_mutex_lock(&wb_lock);
+    int page = wb_lookup(inode_idx, file_block);
+    if (page == -1 && wb_free != -1)
+    {
+        page = wb_free;
+        wb_free = wb_pages[page].next;
+
+        CachePage *p = &wb_pages[page];
+        p->inode_idx = inode_idx;
+        p->file_block = file_block;
+        p->valid_start = p->valid_end = 0;
+        unsigned int bucket = wb_bucket(inode_idx, file_block);
+        p->next = wb_hash[bucket];
+        wb_hash[bucket] = page;
+        wb_inode_pages[inode_idx]++;
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return page;
+}
+
+// Called with wb_lock held
+void wb_free_page(int page)
+{
+    CachePage *p = &wb_pages[page];
+    int *link = &wb_hash[wb_bucket(p->inode_idx, p->file_block)];
+    while (*link != page)
+        link = &wb_pages[*link].next;
+    *link = p->next;
+
+    wb_inode_pages[p->inode_idx]--;
+    p->inode_idx = -1;
+    p->next = wb_free;
+    wb_free = page;
+}
+
+// Completes a partly written page with the block's current contents, so a
+// write that does not touch the cached range can be merged into it
+int fill_page(int inode_idx, CachePage *page)
+{
+    char block[BLOCK_SIZE];
+    int start;
+    if (map_run(inode_idx, page->file_block, 1, 0, &start, NULL, NULL, NULL) < 0)
+        return -1;
+    if (start == 0)
+        memset(block, 0, BLOCK_SIZE);
+    else if (read_cached_run(start, 0, block, BLOCK_SIZE) != 0)
+        return -1;
+
+    memcpy(block + page->valid_start, page->data + page->valid_start, page->valid_end - page->valid_start);
+    memcpy(page->data, block, BLOCK_SIZE);
+    page->valid_start = 0;
+    page->valid_end = BLOCK_SIZE;
+    return 0;
+}
+
+int compare_pages(const void *a, const void *b)
+{
+    long long x = wb_pages[*(const int *)a].file_block;
+    long long y = wb_pages[*(const int *)b].file_block;
+    return (x > y) - (x < y);
+}
+
+// Writes out an inode's cached pages, allocating their blocks now. Adjacent
+// pages go down as one write so they get one contiguous reservation. Pages
+// that fail to write stay cached. Called with the inode locked exclusively.
+int flush_inode_pages(int inode_idx, const char *path)
+{
+    int pages[WRITEBACK_PAGES];
+    int count = 0;
+    pthread_mutex_lock(&wb_lock);
+    for (int i = 0; i < WRITEBACK_PAGES && count < wb_inode_pages[inode_idx]; i++)
+    {
+        if (wb_pages[i].inode_idx == inode_idx)
+            pages[count++] = i;
+    }
+    pthread_mutex_unlock(&wb_lock);
+    if (count == 0)
+        return 0;
+
+    qsort(pages, count, sizeof(int), compare_pages);
+    char *group = malloc((size_t)count * BLOCK_SIZE);
+    if (group == NULL)
+        return -ENOMEM;
+
+    int res = 0;
+    for (int first = 0, last; first < count; first = last + 1)
+    {
+        last = first;
+        while (last + 1 < count &&
+               wb_pages[pages[last + 1]].file_block == wb_pages[pages[last]].file_block + 1 &&
+               wb_pages[pages[last]].valid_end == BLOCK_SIZE && wb_pages[pages[last + 1]].valid_start == 0)
+            last++;
+
+        size_t len = 0;
+        for (int i = first; i <= last; i++)
+        {
+            CachePage *p = &wb_pages[pages[i]];
+            memcpy(group + len, p->data + p->valid_start, p->valid_end - p->valid_start);
+            len += p->valid_end - p->valid_start;
+        }
+
+        CachePage *head = &wb_pages[pages[first]];
+        int written = write_disk_data(inode_idx, path, group, len, head->file_block * BLOCK_SIZE + head->valid_start);
+        if (written < 0)
+        {
+            res = written;
+            continue;
+        }
+
+        pthread_mutex_lock(&wb_lock);
+        for (int i = first; i <= last; i++)
+            wb_free_page(pages[i]);
+        pthread_mutex_unlock(&wb_lock);
+    }
+
+    free(group);
+    return res;
+}
+
+// Discards an inode's cached pages; called with the inode locked exclusively
+void drop_inode_pages(int inode_idx)
+{
+    pthread_mutex_lock(&wb_lock);
+    for (int i = 0; i < WRITEBACK_PAGES && wb_inode_pages[inode_idx] > 0; i++)
+    {
+        if (wb_pages[i].inode_idx == inode_idx)
+            wb_free_page(i);
+    }
+    pthread_mutex_unlock(&wb_lock);
+}
+
+// Makes room in a full cache by flushing the caller's own pages, then those of
+// any other file that is not in use. Returns how many pages are free after.
+int evict_pages(int inode_idx, const char *path)
+{
+    flush_inode_pages(inode_idx, path);
+    for (int i = 0; i < MAX_FILES; i++)
+    {
+        pthread_mutex_lock(&wb_lock);
+        int done = wb_free != -1, cached = wb_inode_pages[i];
+        pthread_mutex_unlock(&wb_lock);
+        if (done)
+            break;
+        if (i == inode_idx || cached == 0)
+            continue;
+
+        // Locking another inode while holding ours would break the lock order
+        if (pthread_rwlock_trywrlock(&inode_locks[i]) != 0)
+            continue;
+        flush_inode_pages(i, "<writeback>");
+        pthread_rwlock_unlock(&inode_locks[i]);
+    }
+
+    int free_pages = 0;
+    pthread_mutex_lock(&wb_lock);
+    for (int i = wb_free; i != -1; i = wb_pages[i].next)
+        free_pages++;
+    pthread_mutex_unlock(&wb_lock);
+    return free_pages;
+}
+
+// Writes out every cached page. Called with no locks held.
+int flush_all_pages()
+{
+    int res = 0;
+    for (int i = 0; i < MAX_FILES; i++)
+    {
+        pthread_mutex_lock(&wb_lock);
+        int cached = wb_inode_pages[i];
+        pthread_mutex_unlock(&wb_lock);
+        if (cached == 0)
+            continue;
+
+        begin_change();
+        pthread_rwlock_wrlock(&inode_locks[i]);
+        int err = flush_inode_pages(i, "<writeback>");
+        pthread_rwlock_unlock(&inode_locks[i]);
+        end_change();
+        if (err < 0)
+            res = err;
+    }
+    return res;
+}
+
+// Copies data into the cache; blocks are allocated when it is flushed. Falls
+// back to writing a block straight to disk when the cache cannot make room.
+// Called with the inode locked exclusively.
+int cache_write(int inode_idx, const char *path, const char *buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        long long file_block = (offset + done) / BLOCK_SIZE;
+        int block_offset = (offset + done) % BLOCK_SIZE;
+        int len = BLOCK_SIZE - block_offset;
+        if ((size_t)len > size - done)
+            len = size - done;
+
+        int page = wb_get_page(inode_idx, file_block);
+        if (page == -1 && evict_pages(inode_idx, path) > 0)
+            page = wb_get_page(inode_idx, file_block);
+        if (page == -1)
+        {
+            int res = write_disk_data(inode_idx, path, buf + done, len, offset + done);
+            if (res < 0)
+                return res;
+            done += len;
+            continue;
+        }
+
+        CachePage *p = &wb_pages[page];
+        if (p->valid_end == 0)
+        {
+            p->valid_start = block_offset;
+            p->valid_end = block_offset + len;
+        }
+        else if (block_offset > p->valid_end || block_offset + len < p->valid_start)
+        {
+            if (fill_page(inode_idx, p) != 0)
+                return -EIO;
+        }
+
+        memcpy(p->data + block_offset, buf + done, len);
+        if (block_offset < p->valid_start)
+            p->valid_start = block_offset;
+        if (block_offset + len > p->valid_end)
+            p->valid_end = block_offset + len;
+        done += len;
+    }
+    return done;
+}
+
+// Copies cached data for [offset, offset + size) over what was read from
+// disk. Called with the inode locked at least shared.
+void cache_read(int inode_idx, char *buf, size_t size, off_t offset)
+{
+    pthread_mutex_lock(&wb_lock);
+    if (wb_inode_pages[inode_idx] > 0)
+    {
+        for (long long b = offset / BLOCK_SIZE; b <= (long long)(offset + size - 1) / BLOCK_SIZE; b++)
+        {
+            int page = wb_lookup(inode_idx, b);
+            if (page == -1)
+                continue;
+
+            CachePage *p = &wb_pages[page];
+            long long lo = b * BLOCK_SIZE + p->valid_start;
+            long long hi = b * BLOCK_SIZE + p->valid_end;
+            if (lo < offset)
+                lo = offset;
+            if (hi > (long long)(offset + size))
+                hi = offset + size;
+            if (lo < hi)
+                memcpy(buf + (lo - offset), p->data + (lo - b * BLOCK_SIZE), hi - lo);
+        }
+    }
+    pthread_mutex_unlock(&wb_lock);
+}
+
+// Background flusher, started at mount with -o writeback
+void *writeback_thread(void *arg)
+{
+    pthread_mutex_lock(&wb_lock);
+    while (!writeback_stop)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WRITEBACK_INTERVAL;
+        pthread_cond_timedwait(&writeback_cond, &wb_lock, &deadline);
+        if (writeback_stop)
+            break;
+
+        pthread_mutex_unlock(&wb_lock);
+        flush_all_pages();
+        save_metadata();
+        pthread_mutex_lock(&wb_lock);
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return NULL;
+}
+
+/* Logging */
+void init_log()
+{
+    for (int i = 0; i < LOG_SLOTS; i++)
+        log_slots[i].seq = i;
+}
+
+// Queues a message for the log thread, or writes it out at once when the
+// thread is not running
+void log_message(int level, const char *fmt, ...)
+{
+    unsigned long pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    LogSlot *slot, overflow;
+    for (;;)
+    {
+        slot = &log_slots[pos & (LOG_SLOTS - 1)];
+        long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0 && __atomic_compare_exchange_n(&log_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+        if (diff < 0) // Not written out yet since the last time round
+        {
+            slot = NULL;
+            break;
+        }
+        if (diff > 0)
+            pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    }
+    if (slot == NULL)
+    {
+        if (level != LVL_ERROR)
+        {
+            __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        slot = &overflow;
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    slot->level = level;
+    slot->tid = (pid_t)syscall(SYS_gettid);
+    vsnprintf(slot->text, LOG_LINE, fmt, ap);
+    va_end(ap);
+
+    if (slot == &overflow)
+    {
+        char out[LOG_LINE + 64];
+        ssize_t ignored = write(STDERR_FILENO, out, log_format(out, sizeof(out), slot));
+        (void)ignored;
+        return;
+    }
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    if (!log_running)
+        log_drain();
+}
+
+// One line: seconds.microseconds, level, thread id, then the message
+int log_format(char *out, size_t size, const LogSlot *slot)
+{
+    static const char *names[] = {"ERROR", "INFO", "DEBUG"};
+    int len = snprintf(out, size, "%ld.%06ld %s %d %s", (long)slot->time.tv_sec, slot->time.tv_nsec / 1000,
+                       names[slot->level], (int)slot->tid, slot->text);
+    if (len >= (int)size)
+        len = size - 1;
+    if (len > 0 && out[len - 1] != '\n') // Cut short
+        out[len - 1] = '\n';
+    return len;
+}
+
+// Writes out the filled slots in order. Only the log thread calls this
+// while it runs.
+void log_drain()
+{
+    char out[16 * (LOG_LINE + 64)];
+    size_t len = 0;
+    for (;;)
+    {
+        LogSlot *slot = &log_slots[log_head & (LOG_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_head + 1)
+            break;
+        if (len + LOG_LINE + 64 > sizeof(out))
+        {
+            ssize_t ignored = write(STDERR_FILENO, out, len);
+            (void)ignored;
+            len = 0;
+        }
+        len += log_format(out + len, sizeof(out) - len, slot);
+        __atomic_store_n(&slot->seq, log_head + LOG_SLOTS, __ATOMIC_RELEASE);
+        log_head++;
+    }
+
+    unsigned long dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0)
+        len += snprintf(out + len, sizeof(out) - len, "LOG: Dropped %lu messages, the log ring was full.\n", dropped);
+    if (len > 0)
+    {
+        ssize_t ignored = write(STDERR_FILENO, out, len);
+        (void)ignored;
+    }
+}
+
+// Started first at mount and stopped last, so every other thread logs through it
+void *log_thread(void *arg)
+{
+    while (!__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE))
+    {
+        struct timespec pause = {0, LOG_INTERVAL_MS * 1000000L};
+        nanosleep(&pause, NULL);
+        log_drain();
+        if (__atomic_exchange_n(&stats_dump_requested, 0, __ATOMIC_ACQ_REL))
+            dump_stats();
+    }
+    log_drain();
+    return NULL;
+}
+
+/* Statistics */
+void init_stats()
+{
+    pthread_key_create(&stats_key, release_thread_stats);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stats_dump;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+// Called as a thread exits: its counts stay in the list for the next thread
+void release_thread_stats(void *stats)
+{
+    pthread_mutex_lock(&stats_lock);
+    ((ThreadStats *)stats)->in_use = 0;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+long long stats_begin()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Records one call of op that started at start. Only the calling thread
+// writes its ThreadStats; the relaxed atomics keep concurrent readers whole.
+void stats_end(int op, long long start, int failed)
+{
+    unsigned long long ns = stats_begin() - start;
+    ThreadStats *ts = pthread_getspecific(stats_key);
+    if (ts == NULL)
+    {
+        pthread_mutex_lock(&stats_lock);
+        for (ts = all_stats; ts != NULL && ts->in_use; ts = ts->next)
+            ;
+        if (ts == NULL && (ts = calloc(1, sizeof(ThreadStats))) != NULL)
+        {
+            ts->next = all_stats;
+            all_stats = ts;
+        }
+        if (ts != NULL)
+            ts->in_use = 1;
+        pthread_mutex_unlock(&stats_lock);
+        if (ts == NULL)
+            return;
+        pthread_setspecific(stats_key, ts);
+    }
+
+    __atomic_fetch_add(&ts->count[op], 1, __ATOMIC_RELAXED);
+    if (failed)
+        __atomic_fetch_add(&ts->errors[op], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ts->total_ns[op], ns, __ATOMIC_RELAXED);
+    if (ns > __atomic_load_n(&ts->max_ns[op], __ATOMIC_RELAXED))
+        __atomic_store_n(&ts->max_ns[op], ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ts->hist[op][hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+// Values below HIST_SUB get a bucket each; above, each power of two is split
+// into HIST_SUB buckets by the bits after the leading one
+int hist_bucket(unsigned long long ns)
+{
+    if (ns < HIST_SUB)
+        return ns;
+    int shift = 63 - __builtin_clzll(ns) - 3; // log2(HIST_SUB)
+    int bucket = (shift + 1) * HIST_SUB + (int)((ns >> shift) & (HIST_SUB - 1));
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+// Highest value that falls in the bucket
+unsigned long long hist_value(int bucket)
+{
+    if (bucket < HIST_SUB)
+        return bucket;
+    int shift = bucket / HIST_SUB - 1;
+    return ((unsigned long long)(HIST_SUB + bucket % HIST_SUB + 1) << shift) - 1;
+}
+
+// Renders one line per operation that has been called, adding up every
+// thread's counts. Returns the length written.
+int format_stats(char *out, size_t size)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    int len = 0;
+    for (int op = 0; op < STAT_OPS && len < (int)size; op++)
+    {
+        unsigned long long count = 0, errors = 0, total = 0, max = 0;
+        unsigned long long hist[HIST_BUCKETS] = {0};
+        pthread_mutex_lock(&stats_lock);
+        for (ThreadStats *ts = all_stats; ts != NULL; ts = ts->next)
+        {
+            count += __atomic_load_n(&ts->count[op], __ATOMIC_RELAXED);
+            errors += __atomic_load_n(&ts->errors[op], __ATOMIC_RELAXED);
+            total += __atomic_load_n(&ts->total_ns[op], __ATOMIC_RELAXED);
+            unsigned long long m = __atomic_load_n(&ts->max_ns[op], __ATOMIC_RELAXED);
+            if (m > max)
+                max = m;
+            for (int b = 0; b < HIST_BUCKETS; b++)
+                hist[b] += __atomic_load_n(&ts->hist[op][b], __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&stats_lock);
+        if (count == 0)
+            continue;
+
+        // The histogram may be a few calls ahead of count, so ranks use its own total
+        unsigned long long seen = 0, p[4];
+        for (int b = 0; b < HIST_BUCKETS; b++)
+            seen += hist[b];
+        for (int q = 0; q < 4; q++)
+        {
+            unsigned long long rank = (unsigned long long)(quantiles[q] * seen + 0.5), sum = 0;
+            int b = 0;
+            while (b < HIST_BUCKETS - 1 && (sum += hist[b]) < rank)
+                b++;
+            p[q] = hist_value(b) < max ? hist_value(b) : max;
+        }
+        len += snprintf(out + len, size - len,
+                        "%-16s count=%llu errors=%llu mean=%.1fus p50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus\n",
+                        stat_names[op], count, errors, total / 1000.0 / count, p[0] / 1000.0, p[1] / 1000.0,
+                        p[2] / 1000.0, p[3] / 1000.0, max / 1000.0);
+    }
+    return len < (int)size ? len : (int)size - 1;
+}
+
+// Writes the statistics to stderr after anything already logged. Called by
+// the log thread, or once it has stopped.
+void dump_stats()
+{
+    char out[STAT_OPS * 192];
+    log_drain();
+    int len = snprintf(out, sizeof(out), "STATS: Operation counts and latencies\n");
+    len += format_stats(out + len, sizeof(out) - len);
+    ssize_t ignored = write(STDERR_FILENO, out, len);
+    (void)ignored;
+}
+
+// SIGUSR1 handler
+void request_stats_dump(int sig)
+{
+    __atomic_store_n(&stats_dump_requested, 1, __ATOMIC_RELEASE);
+}
+
+/* Readahead */
+
+// Tracks the access pattern of a handle after a read. Sequential reads queue
+// the next window of blocks once the reader gets within half a window of what
+// was already prefetched, doubling the window each time; any other read
+// resets it. The window stops growing at a quarter of the block cache so a
+// prefetch never evicts itself.
+void plan_readahead(OpenFile *of, int inode_idx, off_t offset, size_t size)
+{
+    if (block_cache[0].capacity == 0)
+        return;
+
+    long long next_block = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    long long start = 0;
+    int count = 0;
+    pthread_mutex_lock(&open_files_lock);
+    if (offset == of->ra_next)
+    {
+        if (of->ra_end - next_block < of->ra_window / 2)
+        {
+            start = of->ra_end > next_block ? of->ra_end : next_block;
+            count = of->ra_window;
+            if (of->ra_window < READAHEAD_MAX && of->ra_window * 2 <= mount_options.cache_blocks / 4)
+                of->ra_window *= 2;
+            of->ra_end = start + count;
+        }
+    }
+    else
+    {
+        of->ra_window = READAHEAD_MIN;
+        of->ra_end = next_block;
+    }
+    of->ra_next = offset + size;
+    pthread_mutex_unlock(&open_files_lock);
+
+    if (count > 0)
+        queue_readahead(inode_idx, start, count);
+}
+
+void queue_readahead(int inode_idx, long long file_block, int count)
+{
+    pthread_mutex_lock(&ra_lock);
+    if (readahead_running && ra_count < READAHEAD_QUEUE)
+    {
+        ReadaheadRequest *req = &ra_queue[(ra_head + ra_count) % READAHEAD_QUEUE];
+        req->inode_idx = inode_idx;
+        req->file_block = file_block;
+        req->count = count;
+        ra_count++;
+        pthread_cond_signal(&ra_cond);
+    }
+    pthread_mutex_unlock(&ra_lock);
+}
+
+// Reads whichever of count disk blocks are not cached yet into the cache, one
+// request per stretch of missing blocks
+void prefetch_blocks(int block_num, int count)
+{
+    char *blocks = get_io_buffer((size_t)count * BLOCK_SIZE);
+    if (blocks == NULL)
+        return;
+
+    for (int i = 0; i < count;)
+    {
+        if (cache_contains(block_num + i))
+        {
+            i++;
+            continue;
+        }
+
+        int n = 1;
+        while (i + n < count && !cache_contains(block_num + i + n))
+            n++;
+        if (read_blocks(block_num + i, n, blocks) == 0)
+        {
+            for (int j = 0; j < n; j++)
+                cache_put(block_num + i + j, blocks + (size_t)j * BLOCK_SIZE);
+        }
+        i += n;
+    }
+    put_io_buffer(blocks);
+}
+
+// Serves queued prefetches. The inode is read-locked while its blocks are
+// mapped and read, so a write or unlink can't change them underneath.
+void *readahead_thread(void *arg)
+{
+    pthread_mutex_lock(&ra_lock);
+    for (;;)
+    {
+        while (ra_count == 0 && !readahead_stop)
+            pthread_cond_wait(&ra_cond, &ra_lock);
+        if (readahead_stop)
+            break;
+
+        ReadaheadRequest req = ra_queue[ra_head];
+        ra_head = (ra_head + 1) % READAHEAD_QUEUE;
+        ra_count--;
+        pthread_mutex_unlock(&ra_lock);
+
+        pthread_rwlock_rdlock(&inode_locks[req.inode_idx]);
+        long long end = (inodes[req.inode_idx].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (end > req.file_block + req.count)
+            end = req.file_block + req.count;
+        for (long long fb = req.file_block; fb < end;)
+        {
+            int start;
+            int run = map_run(req.inode_idx, fb, end - fb, 0, &start, NULL, NULL, NULL);
+            if (run <= 0)
+                break;
+            if (start != 0)
+                prefetch_blocks(start, run);
+            fb += run;
+        }
+        pthread_rwlock_unlock(&inode_locks[req.inode_idx]);
+
+        pthread_mutex_lock(&ra_lock);
+    }
+    pthread_mutex_unlock(&ra_lock);
+    return NULL;
+}
+
+
+/* Control Files */
+int render_cache(char *out, size_t size)
+{
+    long hits, misses;
+    int capacity = 0, used = 0;
+    cache_stats(&hits, &misses);
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        pthread_mutex_lock(&block_cache[i].lock);
+        capacity += block_cache[i].capacity;
+        for (int j = 0; j < block_cache[i].capacity; j++)
+            used += block_cache[i].slots[j].block_num != 0;
+        pthread_mutex_unlock(&block_cache[i].lock);
+    }
+
+    int indirect_used = 0, indirect_dirty = 0, images = 0, committed_images = 0;
+    pthread_mutex_lock(&map_lock);
+    for (int i = 0; i < INDIRECT_CACHE_SIZE; i++)
+    {
+        indirect_used += indirect_cache[i].block_num != 0;
+        indirect_dirty += indirect_cache[i].block_num != 0 && indirect_cache[i].dirty;
+    }
+    for (BlockImage *img = block_images; img != NULL; img = img->next)
+    {
+        images++;
+        committed_images += img->state == IMAGE_LOGGED;
+    }
+    pthread_mutex_unlock(&map_lock);
+
+    int wb_used = 0;
+    pthread_mutex_lock(&wb_lock);
+    for (int i = 0; i < WRITEBACK_PAGES; i++)
+        wb_used += wb_pages[i].inode_idx != -1;
+    pthread_mutex_unlock(&wb_lock);
+
+    pthread_mutex_lock(&ra_lock);
+    int ra_queued = ra_count;
+    pthread_mutex_unlock(&ra_lock);
+
+    pthread_mutex_lock(&pool_lock);
+    int pool_free = pool_free_count;
+    pthread_mutex_unlock(&pool_lock);
+
+    int handles = 0;
+    pthread_mutex_lock(&open_files_lock);
+    for (int i = 0; i < MAX_OPEN_FILES; i++)
+        handles += open_files[i].in_use;
+    pthread_mutex_unlock(&open_files_lock);
+
+    return snprintf(out, size,
+                    "block_cache: capacity=%d used=%d hits=%ld misses=%ld hit_rate=%.1f%%\n"
+                    "indirect_cache: slots=%d used=%d dirty=%d\n"
+                    "block_images: uncommitted=%d committed=%d\n"
+                    "writeback: pages=%d used=%d\n"
+                    "readahead: queued=%d max=%d\n"
+                    "io_buffers: free=%d total=%d\n"
+                    "open_files: used=%d max=%d\n",
+                    capacity, used, hits, misses, hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0,
+                    INDIRECT_CACHE_SIZE, indirect_used, indirect_dirty,
+                    images - committed_images, committed_images,
+                    mount_options.writeback ? WRITEBACK_PAGES : 0, wb_used,
+                    ra_queued, READAHEAD_QUEUE,
+                    pool_free, mount_options.direct ? POOL_BUFFERS : 0,
+                    handles, MAX_OPEN_FILES);
+}
+
+// Free space and how it is split into runs of free data blocks
+int render_alloc(char *out, size_t size)
+{
+    int free_blocks = 0, runs = 0, largest = 0, run = 0, used_inodes = 0;
+    pthread_mutex_lock(&alloc_lock);
+    for (int b = DATA_BLOCK_START; b < TOTAL_BLOCKS; b++)
+    {
+        if (bitmap[b / 8] & (1 << (b % 8)))
+        {
+            run = 0;
+            continue;
+        }
+        free_blocks++;
+        if (run++ == 0)
+            runs++;
+        if (run > largest)
+            largest = run;
+    }
+    for (int i = 0; i < MAX_FILES; i++)
+        used_inodes += (inode_bitmap[i / 8] >> (i % 8)) & 1;
+    int cursor = alloc_cursor * 64;
+    pthread_mutex_unlock(&alloc_lock);
+
+    int data_blocks = TOTAL_BLOCKS - DATA_BLOCK_START;
+    return snprintf(out, size,
+                    "blocks: total=%d data=%d used=%d free=%d\n"
+                    "free_runs: count=%d largest=%d mean=%.1f\n"
+                    "fragmentation: %.1f%%\n"
+                    "next_fit: block=%d\n"
+                    "inodes: total=%d used=%d\n",
+                    TOTAL_BLOCKS, data_blocks, data_blocks - free_blocks, free_blocks,
+                    runs, largest, runs > 0 ? (double)free_blocks / runs : 0.0,
+                    free_blocks > 0 ? 100.0 * (free_blocks - largest) / free_blocks : 0.0,
+                    cursor,
+                    MAX_FILES, used_inodes);
+}
+
+// Metadata waiting to be committed, the journal and the commit queue
+int render_meta(char *out, size_t size)
+{
+    int dirty_inode_count = 0, dirty_entry_count = 0;
+    pthread_mutex_lock(&meta_lock);
+    for (int i = 0; i < MAX_FILES; i++)
+    {
+        dirty_inode_count += (dirty_inodes[i / 8] >> (i % 8)) & 1;
+        dirty_entry_count += (dirty_entries[i / 8] >> (i % 8)) & 1;
+    }
+    pthread_mutex_unlock(&meta_lock);
+
+    pthread_mutex_lock(&alloc_lock);
+    int bitmap_bytes = bitmap_dirty_end > bitmap_dirty_start ? bitmap_dirty_end - bitmap_dirty_start : 0;
+    int inode_map = inode_bitmap_dirty;
+    pthread_mutex_unlock(&alloc_lock);
+
+    pthread_mutex_lock(&flush_lock);
+    int head = journal_head;
+    long long seq = journal_seq;
+    int pending = ckpt_pending;
+    pthread_mutex_unlock(&flush_lock);
+
+    pthread_mutex_lock(&group_lock);
+    long long requested = commit_requested, done = commit_done;
+    pthread_mutex_unlock(&group_lock);
+
+    return snprintf(out, size,
+                    "dirty: inodes=%d entries=%d bitmap_bytes=%d inode_map=%d\n"
+                    "journal: used=%d blocks=%d next_seq=%lld checkpoint_pending=%d\n"
+                    "group_commit: requested=%lld done=%lld waiting=%lld\n",
+                    dirty_inode_count, dirty_entry_count, bitmap_bytes, inode_map,
+                    head - 1, JOURNAL_BLOCKS - 1, seq, pending,
+                    requested, done, requested - done);
+}
+
+static const ControlFile control_files[] = {
+    {"stats", format_stats},
+    {"cache", render_cache},
+    {"alloc", render_alloc},
+    {"meta", render_meta},
+};
+
+#define CONTROL_FILES ((int)(sizeof(control_files) / sizeof(control_files[0])))
+
+// True for /.bfs and anything under it
+int is_control_path(const char *path)
+{
+    size_t len = strlen(CONTROL_DIR);
+    return strncmp(path, CONTROL_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// Returns the control file at path, or -1
+int find_control_file(const char *path)
 {
-    if (size > BLOCK_SIZE)
-    {
-        fprintf(stderr, "WRITE_PARTIAL_BLOCK ERROR: Buffer size exceeds block size\n");
+    size_t len = strlen(CONTROL_DIR);
+    if (!is_control_path(path) || path[len] != '/')
         return -1;
-    }
+    for (int i = 0; i < CONTROL_FILES; i++)
+        if (strcmp(path + len + 1, control_files[i].name) == 0)
+            return i;
+    return -1;
+}
 
-    if (lseek(fd_disk, block_num * BLOCK_SIZE, SEEK_SET) == -1)
+int control_getattr(const char *path, struct stat *stbuf)
+{
+    if (strcmp(path, CONTROL_DIR) == 0)
     {
-        perror("WRITE_PARTIAL_BLOCK ERROR: lseek failed");
-        return -1;
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+        return 0;
     }
 
-    if (write(fd_disk, buf, size) != size)
-    {
-        perror("WRITE_PARTIAL_BLOCK ERROR: write failed");
-        return -1;
-    }
+    int file = find_control_file(path);
+    if (file == -1)
+        return -ENOENT;
 
+    // The size is what a read would see right now
+    char *text = malloc(CONTROL_SIZE);
+    if (text == NULL)
+        return -ENOMEM;
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = control_files[file].render(text, CONTROL_SIZE);
+    stbuf->st_mtime = stbuf->st_ctime = stbuf->st_atime = time(NULL);
+    free(text);
     return 0;
 }
 
-/* Initialization */
-void initialize_filesystem()
+int control_readdir(void *buf, fuse_fill_dir_t filler)
 {
-    // Verify bitmap size
-    if (sizeof(bitmap) != BLOCK_SIZE)
-    {
-        fprintf(stderr, "ERROR: Invalid bitmap size.\n");
-        exit(1);
-    }
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+    for (int i = 0; i < CONTROL_FILES; i++)
+        filler(buf, control_files[i].name, NULL, 0, 0);
+    return 0;
+}
 
-    // Load bitmap
-    read_block(BITMAP_BLOCK, bitmap);
+// Renders the file into a control handle. Handles are numbered after the
+// open file table, so get_open_file() never mistakes one for a file.
+int control_open(const char *path, struct fuse_file_info *fi)
+{
+    int file = find_control_file(path);
+    if (file == -1)
+        return strcmp(path, CONTROL_DIR) == 0 ? -EISDIR : -ENOENT;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EROFS;
 
-    // Load directory
-    read_block(ROOT_DIR_BLOCK, directory);
+    char *text = malloc(CONTROL_SIZE);
+    if (text == NULL)
+        return -ENOMEM;
+    int len = control_files[file].render(text, CONTROL_SIZE);
 
-    // Load inodes, checking for overflows
-    for (int i = 0; i < MAX_FILES; i++)
+    pthread_mutex_lock(&control_lock);
+    for (int i = 0; i < CONTROL_HANDLES; i++)
     {
-        if (INODE_TABLE_START + i >= TOTAL_BLOCKS)
+        if (control_text[i] == NULL)
         {
-            fprintf(stderr, "ERROR: Inode index exceeds available blocks.\n");
-            exit(1);
+            control_text[i] = text;
+            control_len[i] = len;
+            pthread_mutex_unlock(&control_lock);
+            fi->fh = MAX_OPEN_FILES + 1 + i;
+            fi->direct_io = 1; // Keep the kernel from caching a stale snapshot
+            return 0;
         }
-        read_block(INODE_TABLE_START + i, &inodes[i]);
     }
+    pthread_mutex_unlock(&control_lock);
+    free(text);
+    return -ENFILE;
 }
 
-void save_metadata() {
-    fprintf(stderr, "SAVE METADATA: Saving inode bitmap...\n");
-    if (write_partial_block(BITMAP_BLOCK, inode_bitmap, sizeof(inode_bitmap)) != 0) {
-        fprintf(stderr, "SAVE METADATA ERROR: Failed to save inode bitmap.\n");
-    }
+// Reads from the handle's snapshot, or from a fresh one without a handle
+int control_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    int file = find_control_file(path);
+    if (file == -1)
+        return strcmp(path, CONTROL_DIR) == 0 ? -EISDIR : -ENOENT;
 
-    fprintf(stderr, "SAVE METADATA: Saving block bitmap...\n");
-    if (write_partial_block(BITMAP_BLOCK + 1, bitmap, BLOCK_SIZE) != 0) {
-        fprintf(stderr, "SAVE METADATA ERROR: Failed to save block bitmap.\n");
+    int handle = fi != NULL ? (int)fi->fh - MAX_OPEN_FILES - 1 : -1;
+    if (handle >= 0 && handle < CONTROL_HANDLES)
+    {
+        pthread_mutex_lock(&control_lock);
+        int len = control_len[handle];
+        int res = offset < len ? (size < (size_t)(len - offset) ? (int)size : len - (int)offset) : 0;
+        if (control_text[handle] != NULL && res > 0)
+            memcpy(buf, control_text[handle] + offset, res);
+        pthread_mutex_unlock(&control_lock);
+        return res;
     }
 
-    fprintf(stderr, "SAVE METADATA: Saving directory and inode table...\n");
-    if (write_block(ROOT_DIR_BLOCK, directory) != 0) {
-        fprintf(stderr, "SAVE METADATA ERROR: Failed to save directory.\n");
-    }
+    char *text = malloc(CONTROL_SIZE);
+    if (text == NULL)
+        return -ENOMEM;
+    int len = control_files[file].render(text, CONTROL_SIZE);
+    int res = offset < len ? (size < (size_t)(len - offset) ? (int)size : len - (int)offset) : 0;
+    if (res > 0)
+        memcpy(buf, text + offset, res);
+    free(text);
+    return res;
+}
 
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (write_block(INODE_TABLE_START + i, &inodes[i]) != 0) {
-            fprintf(stderr, "SAVE METADATA ERROR: Failed to save inode %d.\n", i);
-        }
-    }
-    fprintf(stderr, "SAVE METADATA: Metadata saved successfully.\n");
+void control_release(struct fuse_file_info *fi)
+{
+    int handle = (int)fi->fh - MAX_OPEN_FILES - 1;
+    if (handle < 0 || handle >= CONTROL_HANDLES)
+        return;
+    pthread_mutex_lock(&control_lock);
+    free(control_text[handle]);
+    control_text[handle] = NULL;
+    pthread_mutex_unlock(&control_lock);
+    fi->fh = 0;
 }
 
 
 /* FUSE Callbacks */
 int bfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
-    fprintf(stderr, "GETATTR: path=%s\n", path);
+    bfs_log(LVL_DEBUG, "GETATTR: path=%s\n", path);
 
     memset(stbuf, 0, sizeof(struct stat));
     if (strcmp(path, "/") == 0) {
         stbuf->st_mode = S_IFDIR | 0755; // Root directory
         stbuf->st_nlink = 2;
-        fprintf(stderr, "GETATTR: Root directory found\n");
+        bfs_log(LVL_DEBUG, "GETATTR: Root directory found\n");
         return 0;
     }
+    if (is_control_path(path))
+        return control_getattr(path, stbuf);
 
-    int file_idx = find_file(path + 1); // Remove leading '/'
-    if (file_idx == -1) {
-        fprintf(stderr, "GETATTR ERROR: File not found: %s\n", path);
+    int inode_idx = lock_inode(path, fi, 0);
+    if (inode_idx == -1) {
+        bfs_log(LVL_DEBUG, "GETATTR: File not found: %s\n", path);
         return -ENOENT;
     }
 
-    DirectoryEntry *entry = &directory[file_idx];
-    Inode *inode = &inodes[entry->inode_num - 1];
+    Inode *inode = &inodes[inode_idx];
 
     stbuf->st_mode = S_IFREG | inode->permissions;
     stbuf->st_nlink = inode->ref_count;
@@ -341,74 +4455,124 @@ int bfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
     stbuf->st_atime = inode->creation_time;
     stbuf->st_mtime = inode->modification_time;
     stbuf->st_ctime = inode->modification_time;
+    unlock_inode(inode_idx);
 
-    fprintf(stderr, "GETATTR: File=%s found, inode=%d\n", path, entry->inode_num);
+    bfs_log(LVL_DEBUG, "GETATTR: File=%s found, inode=%d\n", path, inode_idx + 1);
     return 0;
 }
 
 
 int bfs_open(const char *path, struct fuse_file_info *fi)
 {
-    fprintf(stderr, "OPEN: path=%s\n", path);
+    bfs_log(LVL_DEBUG, "OPEN: path=%s\n", path);
+    if (is_control_path(path))
+        return control_open(path, fi);
 
-    if (find_file(path + 1) == -1)
+    pthread_rwlock_rdlock(&dir_lock);
+    int file_idx = find_file(path + 1);
+    if (file_idx == -1)
     {
-        fprintf(stderr, "OPEN ERROR: File not found: %s\n", path);
+        pthread_rwlock_unlock(&dir_lock);
+        bfs_log(LVL_DEBUG, "OPEN: File not found: %s\n", path);
         return -ENOENT;
     }
 
-    fprintf(stderr, "OPEN: File=%s opened successfully\n", path);
+    int fh = alloc_open_file(directory[file_idx].inode_num - 1);
+    pthread_rwlock_unlock(&dir_lock);
+    if (fh == -1)
+    {
+        bfs_log(LVL_ERROR, "OPEN ERROR: Open file table full, cannot open file=%s\n", path);
+        return -ENFILE;
+    }
+    fi->fh = fh;
+
+    bfs_log(LVL_DEBUG, "OPEN: File=%s opened successfully\n", path);
     return 0; // Success
 }
 
 int bfs_access(const char *path, int mask)
 {
-    fprintf(stderr, "ACCESS: path=%s, mask=%d\n", path, mask);
+    bfs_log(LVL_DEBUG, "ACCESS: path=%s, mask=%d\n", path, mask);
+    if (is_control_path(path))
+    {
+        if (strcmp(path, CONTROL_DIR) != 0 && find_control_file(path) == -1)
+            return -ENOENT;
+        return (mask & W_OK) ? -EROFS : 0;
+    }
 
+    pthread_rwlock_rdlock(&dir_lock);
     int file_idx = find_file(path + 1);
+    pthread_rwlock_unlock(&dir_lock);
     if (file_idx == -1)
     {
-        fprintf(stderr, "ACCESS ERROR: File not found: %s\n", path);
+        bfs_log(LVL_DEBUG, "ACCESS: File not found: %s\n", path);
         return -ENOENT;
     }
 
     // Simplified access check
-    fprintf(stderr, "ACCESS: File=%s is accessible\n", path);
+    bfs_log(LVL_DEBUG, "ACCESS: File=%s is accessible\n", path);
     return 0; // Success
 }
 
 int bfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
 {
-    fprintf(stderr, "READDIR: path=%s\n", path);
+    bfs_log(LVL_DEBUG, "READDIR: path=%s\n", path);
 
+    if (strcmp(path, CONTROL_DIR) == 0)
+        return control_readdir(buf, filler);
     if (strcmp(path, "/") != 0)
     {
-        fprintf(stderr, "READDIR ERROR: Only root directory supported\n");
+        bfs_log(LVL_ERROR, "READDIR ERROR: Only root directory supported\n");
         return -ENOENT;
     }
 
     // Add current directory and parent directory entries
     filler(buf, ".", NULL, 0, 0);
     filler(buf, "..", NULL, 0, 0);
+    filler(buf, CONTROL_DIR + 1, NULL, 0, 0);
 
     // Add entries for files in the root directory
+    pthread_rwlock_rdlock(&dir_lock);
     for (int i = 0; i < MAX_FILES; i++)
     {
         if (directory[i].inode_num > 0)
         {
-            fprintf(stderr, "READDIR: Found entry=%s\n", directory[i].name);
+            bfs_log(LVL_DEBUG, "READDIR: Found entry=%s\n", directory[i].name);
             filler(buf, directory[i].name, NULL, 0, 0);
         }
     }
+    pthread_rwlock_unlock(&dir_lock);
 
-    fprintf(stderr, "READDIR: Completed listing directory contents\n");
+    bfs_log(LVL_DEBUG, "READDIR: Completed listing directory contents\n");
     return 0;
 }
 
 int bfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-    fprintf(stderr, "CREATE: path=%s, mode=%o\n", path, mode);
+    bfs_log(LVL_DEBUG, "CREATE: path=%s, mode=%o\n", path, mode);
+    if (is_control_path(path))
+    {
+        bfs_log(LVL_DEBUG, "CREATE: %s is read-only\n", path);
+        return strcmp(path, CONTROL_DIR) == 0 ? -EEXIST : -EROFS;
+    }
+
+    if (strlen(path + 1) >= FILENAME_LEN)
+    {
+        bfs_log(LVL_ERROR, "CREATE ERROR: File name too long: %s\n", path);
+        return -ENAMETOOLONG;
+    }
+
+    // Take the handle first, so a full table fails before anything changes
+    int fh = alloc_open_file(-1);
+    if (fh == -1)
+    {
+        bfs_log(LVL_ERROR, "CREATE ERROR: Open file table full, cannot create file=%s\n", path);
+        return -ENFILE;
+    }
+    fi->fh = fh;
 
+    begin_change();
+    pthread_rwlock_wrlock(&dir_lock);
     for (int i = 0; i < MAX_FILES; i++)
     {
         if (directory[i].inode_num == 0)
@@ -416,7 +4580,10 @@ int bfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
             // Check for duplicate name
             if (find_file(path + 1) != -1)
             {
-                fprintf(stderr, "CREATE ERROR: File=%s already exists\n", path);
+                pthread_rwlock_unlock(&dir_lock);
+                end_change();
+                free_open_file(fi);
+                bfs_log(LVL_ERROR, "CREATE ERROR: File=%s already exists\n", path);
                 return -EEXIST;
             }
 
@@ -424,244 +4591,904 @@ int bfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
             int inode_idx = find_free_inode();
             if (inode_idx == -1)
             {
-                fprintf(stderr, "CREATE ERROR: No free inodes available\n");
+                pthread_rwlock_unlock(&dir_lock);
+                end_change();
+                free_open_file(fi);
+                bfs_log(LVL_ERROR, "CREATE ERROR: No free inodes available\n");
                 return -ENOSPC;
             }
 
             strncpy(directory[i].name, path + 1, FILENAME_LEN);
             directory[i].inode_num = inode_idx + 1; // 1-based indexing
+            name_index_insert(i);
 
+            pthread_rwlock_wrlock(&inode_locks[inode_idx]);
             Inode *inode = &inodes[inode_idx];
             memset(inode, 0, sizeof(Inode));
             inode->permissions = mode;
             inode->creation_time = inode->modification_time = time(NULL);
             inode->ref_count = 1;
+            if (mount_options.extents)
+                inode->flags |= INODE_EXTENTS;
+            pthread_rwlock_unlock(&inode_locks[inode_idx]);
 
-            save_metadata();
-            fprintf(stderr, "CREATE: File=%s created successfully\n", path);
+            mark_entry_dirty(i);
+            mark_inode_dirty(inode_idx);
+            attach_open_file(fh, inode_idx);
+            pthread_rwlock_unlock(&dir_lock);
+            end_change();
+            commit_metadata();
+            bfs_log(LVL_DEBUG, "CREATE: File=%s created successfully\n", path);
             return 0;
         }
     }
 
-    fprintf(stderr, "CREATE ERROR: Directory full, cannot create file=%s\n", path);
+    pthread_rwlock_unlock(&dir_lock);
+    end_change();
+    free_open_file(fi);
+    bfs_log(LVL_ERROR, "CREATE ERROR: Directory full, cannot create file=%s\n", path);
     return -ENOSPC;
 }
 
 
 int bfs_unlink(const char *path)
 {
-    fprintf(stderr, "UNLINK: Attempting to delete file at path=%s\n", path);
+    bfs_log(LVL_DEBUG, "UNLINK: Attempting to delete file at path=%s\n", path);
+    if (is_control_path(path))
+    {
+        bfs_log(LVL_DEBUG, "UNLINK: %s is read-only\n", path);
+        return -EROFS;
+    }
 
-    for (int i = 0; i < MAX_FILES; i++)
+    begin_change();
+    pthread_rwlock_wrlock(&dir_lock);
+    int i = find_file(path + 1);
+    if (i == -1)
     {
-        if (strcmp(directory[i].name, path + 1) == 0)
-        {
-            int inode_num = directory[i].inode_num - 1; // Convert to 0-based index
-            release_inode(inode_num);
+        pthread_rwlock_unlock(&dir_lock);
+        end_change();
+        bfs_log(LVL_DEBUG, "UNLINK: File not found at path=%s\n", path);
+        return -ENOENT;
+    }
 
-            Inode *inode = &inodes[inode_num];
-            for (int j = 0; j < DIRECT_BLOCKS; j++)
-            {
-                if (inode->block_pointers[j] != 0)
-                {
-                    release_block(inode->block_pointers[j]);
-                }
-            }
+    // Waits out any read or write still using the inode
+    int inode_num = directory[i].inode_num - 1; // Convert to 0-based index
+    pthread_rwlock_wrlock(&inode_locks[inode_num]);
 
-            memset(&directory[i], 0, sizeof(DirectoryEntry));
-            memset(inode, 0, sizeof(Inode));
+    drop_inode_pages(inode_num);
+    name_index_remove(i);
+    memset(&directory[i], 0, sizeof(DirectoryEntry));
+    mark_entry_dirty(i);
+    if (!invalidate_open_files(inode_num))
+        delete_inode(inode_num);
+    pthread_rwlock_unlock(&inode_locks[inode_num]);
+    pthread_rwlock_unlock(&dir_lock);
+    end_change();
+    commit_metadata();
+    bfs_log(LVL_DEBUG, "UNLINK: File=%s successfully unlinked\n", path);
+    return 0;
+}
 
-            save_metadata();
-            fprintf(stderr, "UNLINK: File=%s successfully unlinked\n", path);
-            return 0;
-        }
+
+int bfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    bfs_log(LVL_DEBUG, "READ: path=%s, size=%zu, offset=%ld\n", path, size, offset);
+    if (is_control_path(path))
+        return control_read(path, buf, size, offset, fi);
+
+    int inode_idx = lock_inode(path, fi, 0);
+    if (inode_idx == -1) {
+        bfs_log(LVL_DEBUG, "READ: File not found: %s\n", path);
+        return -ENOENT;
     }
 
-    fprintf(stderr, "UNLINK ERROR: File not found at path=%s\n", path);
-    return -ENOENT;
-}
+    int res = read_file_data(inode_idx, path, buf, size, offset);
+    unlock_inode(inode_idx);
 
+    OpenFile *of = get_open_file(fi);
+    if (of != NULL && res > 0)
+        plan_readahead(of, inode_idx, offset, res);
+    return res;
+}
 
-int bfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    fprintf(stderr, "READ: path=%s, size=%zu, offset=%ld\n", path, size, offset);
+int bfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    bfs_log(LVL_DEBUG, "READ_BUF: path=%s, size=%zu, offset=%ld\n", path, size, offset);
+    if (is_control_path(path)) {
+        struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec));
+        char *mem = malloc(size > 0 ? size : 1);
+        int res = bv == NULL || mem == NULL ? -ENOMEM : control_read(path, mem, size, offset, fi);
+        if (res < 0) {
+            free(bv);
+            free(mem);
+            return res;
+        }
+        *bv = FUSE_BUFVEC_INIT(res);
+        bv->buf[0].mem = mem;
+        *bufp = bv;
+        return 0;
+    }
 
-    int file_idx = find_file(path + 1);
-    if (file_idx == -1) {
-        fprintf(stderr, "READ ERROR: File not found: %s\n", path);
+    int inode_idx = lock_inode(path, fi, 0);
+    if (inode_idx == -1) {
+        bfs_log(LVL_DEBUG, "READ_BUF: File not found: %s\n", path);
         return -ENOENT;
     }
 
-    Inode *inode = &inodes[directory[file_idx].inode_num - 1];
-    if (offset >= inode->size) {
-        fprintf(stderr, "READ: Offset beyond EOF for file=%s\n", path);
-        return 0; // EOF
+    // O_DIRECT descriptors can't be spliced from, and data still in the
+    // write-back cache is not on disk yet. Only reads through a handle are
+    // spliced, as the handle keeps the blocks from being freed and reused
+    // before libfuse is done with them.
+    OpenFile *of = get_open_file(fi);
+    pthread_mutex_lock(&wb_lock);
+    int cached = wb_inode_pages[inode_idx];
+    pthread_mutex_unlock(&wb_lock);
+    if (size >= SPLICE_MIN_READ && !mount_options.direct && cached == 0 && of != NULL) {
+        int res = read_file_extents(inode_idx, path, bufp, size, offset);
+        unlock_inode(inode_idx);
+        size_t mapped = res == 0 ? fuse_buf_size(*bufp) : 0;
+        if (mapped > 0)
+            plan_readahead(of, inode_idx, offset, mapped);
+        return res;
+    }
+
+    // Anything else is read into memory through the block cache
+    struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec));
+    char *mem = malloc(size > 0 ? size : 1);
+    if (bv == NULL || mem == NULL) {
+        unlock_inode(inode_idx);
+        free(bv);
+        free(mem);
+        return -ENOMEM;
     }
+    *bv = FUSE_BUFVEC_INIT(size);
+    bv->buf[0].mem = mem;
+
+    int res = read_file_data(inode_idx, path, mem, size, offset);
+    unlock_inode(inode_idx);
+    if (res < 0) {
+        free(mem);
+        free(bv);
+        return res;
+    }
+    bv->buf[0].size = res;
+    *bufp = bv;
+
+    if (of != NULL && res > 0)
+        plan_readahead(of, inode_idx, offset, res);
+    return 0;
+}
+
+// Frees a vector built by read_file_extents() and its memory buffers
+void free_extent_bufs(struct fuse_bufvec *bv)
+{
+    for (size_t i = 0; i < bv->count; i++)
+        free(bv->buf[i].mem);
+    free(bv);
+}
+
+// Describes file data as one buffer per run of disk-contiguous blocks, each
+// pointing into the disk image by offset, and one zero-filled buffer per
+// hole. Blocks in the block cache, prefetched by readahead or read recently,
+// are copied into memory buffers instead. libfuse frees the vector and the
+// memory buffers once it has copied the data out, after the inode is
+// unlocked, so a write racing with the copy may or may not be seen, as with
+// the kernel's own reads. Called with the inode locked at least shared.
+int read_file_extents(int inode_idx, const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset) {
+    Inode *inode = &inodes[inode_idx];
+    if (offset >= inode->size)
+        size = 0;
+    else if (size > (size_t)(inode->size - offset))
+        size = inode->size - offset;
+
+    // Every buffer covers at least one block of its own
+    long long max_bufs = (offset % BLOCK_SIZE + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (max_bufs == 0)
+        max_bufs = 1;
+    struct fuse_bufvec *bv = calloc(1, sizeof(struct fuse_bufvec) + (max_bufs - 1) * sizeof(struct fuse_buf));
+    if (bv == NULL)
+        return -ENOMEM;
+    bv->count = 0;
 
     size_t bytes_read = 0;
-    while (bytes_read < size && offset + bytes_read < inode->size) {
-        size_t block_idx = (offset + bytes_read) / BLOCK_SIZE;
+    while (bytes_read < size) {
+        long long block_idx = (offset + bytes_read) / BLOCK_SIZE;
         size_t block_offset = (offset + bytes_read) % BLOCK_SIZE;
+        long long blocks = (block_offset + size - bytes_read + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-        if (block_idx >= DIRECT_BLOCKS) {
-            fprintf(stderr, "READ ERROR: Indirect blocks not implemented for file=%s\n", path);
-            return -EIO;
+        int start;
+        int run = map_run(inode_idx, block_idx, blocks, 0, &start, NULL, NULL, NULL);
+        if (run < 0) {
+            bfs_log(LVL_ERROR, "READ_BUF ERROR: Failed to map block %lld for file=%s\n", block_idx, path);
+            free_extent_bufs(bv);
+            return run;
         }
 
-        char block[BLOCK_SIZE] = {0};
+        size_t len = (size_t)run * BLOCK_SIZE - block_offset;
+        if (len > size - bytes_read)
+            len = size - bytes_read;
 
-        if (inode->block_pointers[block_idx] == 0) {
-            fprintf(stderr, "READ ERROR: Unallocated block %zu for file=%s\n", block_idx, path);
-            break;
+        if (start == 0) {
+            // Holes left by writes past EOF read back as zeros
+            struct fuse_buf *buf = &bv->buf[bv->count];
+            buf->size = len;
+            buf->mem = calloc(1, len);
+            if (buf->mem == NULL) {
+                free_extent_bufs(bv);
+                return -ENOMEM;
+            }
+            bv->count++;
+            bytes_read += len;
+            continue;
         }
 
-        if (read_block(inode->block_pointers[block_idx], block) != 0) {
-            fprintf(stderr, "READ ERROR: Failed to read block %zu for file=%s\n", block_idx, path);
-            return -EIO;
+        // Split the run where it goes in or out of the block cache; pos and
+        // end are byte offsets from its first block
+        size_t pos = block_offset, end = block_offset + len;
+        while (pos < end) {
+            int in_cache = cache_contains(start + pos / BLOCK_SIZE);
+            size_t piece_end = (pos / BLOCK_SIZE + 1) * BLOCK_SIZE;
+            while (piece_end < end && cache_contains(start + piece_end / BLOCK_SIZE) == in_cache)
+                piece_end += BLOCK_SIZE;
+            if (piece_end > end)
+                piece_end = end;
+
+            struct fuse_buf *buf = &bv->buf[bv->count];
+            buf->size = piece_end - pos;
+            if (in_cache) {
+                buf->mem = malloc(buf->size);
+                if (buf->mem == NULL ||
+                    read_cached_run(start + pos / BLOCK_SIZE, pos % BLOCK_SIZE, buf->mem, buf->size) != 0) {
+                    int err = buf->mem == NULL ? -ENOMEM : -EIO;
+                    bfs_log(LVL_ERROR, "READ_BUF ERROR: Failed to read block %d for file=%s\n", start + (int)(pos / BLOCK_SIZE), path);
+                    bv->count++;
+                    free_extent_bufs(bv);
+                    return err;
+                }
+            } else {
+                buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+                buf->fd = fd_disk;
+                buf->pos = (off_t)start * BLOCK_SIZE + pos;
+            }
+            bv->count++;
+            pos = piece_end;
+        }
+        bytes_read += len;
+    }
+
+    if (bv->count == 0) {
+        bv->count = 1; // An empty memory buffer stands for EOF
+        bv->buf[0].mem = NULL;
+    }
+    *bufp = bv;
+    bfs_log(LVL_DEBUG, "READ_BUF: Mapped %zu bytes of file=%s in %zu buffers\n", bytes_read, path, bv->count);
+    return 0;
+}
+
+// Reads file data; called with the inode locked at least shared
+int read_file_data(int inode_idx, const char *path, char *buf, size_t size, off_t offset) {
+    Inode *inode = &inodes[inode_idx];
+    if (offset >= inode->size) {
+        bfs_log(LVL_DEBUG, "READ: Offset beyond EOF for file=%s\n", path);
+        return 0; // EOF
+    }
+
+    if (size > (size_t)(inode->size - offset)) {
+        size = inode->size - offset;
+    }
+
+    // Each pass queues one run of disk-contiguous blocks as one request, and
+    // the requests for the whole read are submitted together
+    IoBatch batch;
+    CacheFill fills[IO_BATCH];
+    batch.count = 0;
+    size_t bytes_read = 0;
+    while (bytes_read < size) {
+        long long block_idx = (offset + bytes_read) / BLOCK_SIZE;
+        size_t block_offset = (offset + bytes_read) % BLOCK_SIZE;
+        long long blocks = (block_offset + size - bytes_read + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        int start;
+        int run = map_run(inode_idx, block_idx, blocks, 0, &start, NULL, NULL, NULL);
+        if (run < 0) {
+            bfs_log(LVL_ERROR, "READ ERROR: Failed to map block %lld for file=%s\n", block_idx, path);
+            finish_reads(&batch, fills);
+            return run;
         }
 
-        size_t bytes_to_copy = BLOCK_SIZE - block_offset;
-        if (bytes_to_copy > size - bytes_read) {
-            bytes_to_copy = size - bytes_read;
+        size_t len = (size_t)run * BLOCK_SIZE - block_offset;
+        if (len > size - bytes_read) {
+            len = size - bytes_read;
         }
-        if (bytes_to_copy > inode->size - offset - bytes_read) {
-            bytes_to_copy = inode->size - offset - bytes_read;
+
+        // Holes left by writes past EOF read back as zeros
+        if (start == 0) {
+            memset(buf + bytes_read, 0, len);
+        } else if (queue_run_read(&batch, fills, start, block_offset, buf + bytes_read, len) != 0) {
+            bfs_log(LVL_ERROR, "READ ERROR: Failed to read blocks %lld-%lld for file=%s\n", block_idx, block_idx + run - 1, path);
+            finish_reads(&batch, fills);
+            return -EIO;
         }
+        bytes_read += len;
+    }
 
-        memcpy(buf + bytes_read, block + block_offset, bytes_to_copy);
-        bytes_read += bytes_to_copy;
+    if (finish_reads(&batch, fills) != 0) {
+        bfs_log(LVL_ERROR, "READ ERROR: Failed to read data for file=%s\n", path);
+        return -EIO;
     }
 
-    fprintf(stderr, "READ: Successfully read %zu bytes from file=%s\n", bytes_read, path);
+    cache_read(inode_idx, buf, bytes_read, offset);
+
+    bfs_log(LVL_DEBUG, "READ: Successfully read %zu bytes from file=%s\n", bytes_read, path);
     return bytes_read;
 }
 
 
 int bfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    fprintf(stderr, "WRITE: path=%s, size=%zu, offset=%ld\n", path, size, offset);
+    bfs_log(LVL_DEBUG, "WRITE: path=%s, size=%zu, offset=%ld\n", path, size, offset);
 
-    int file_idx = find_file(path + 1);
-    if (file_idx == -1) {
-        fprintf(stderr, "WRITE ERROR: File not found: %s\n", path);
+    int res = write_file_data(path, fi, buf, size, offset);
+    if (res == -ENOENT)
+        bfs_log(LVL_DEBUG, "WRITE: File not found: %s\n", path);
+    if (res < 0)
+        return res;
+
+    note_write(path, fi);
+    bfs_log(LVL_DEBUG, "WRITE: Successfully wrote %d bytes to file=%s\n", res, path);
+    return res;
+}
+
+int bfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    size_t size = fuse_buf_size(buf);
+    bfs_log(LVL_DEBUG, "WRITE_BUF: path=%s, size=%zu, offset=%ld\n", path, size, offset);
+
+    // Data spliced from /dev/fuse arrives in a pipe and can be spliced on into
+    // the disk image, unless it is bound for the write-back cache or an
+    // O_DIRECT descriptor
+    int spliced = 0;
+    for (size_t i = buf->idx; i < buf->count; i++) {
+        if (buf->buf[i].flags & FUSE_BUF_IS_FD)
+            spliced = 1;
+    }
+    int to_disk = spliced && !mount_options.writeback && !mount_options.direct;
+
+    // Anything else is written from memory, copied out of the pipe if need be
+    char *mem = NULL, *copy = NULL;
+    if (!to_disk) {
+        if (buf->count - buf->idx == 1 && !spliced) {
+            mem = (char *)buf->buf[buf->idx].mem + buf->off;
+        } else {
+            mem = copy = malloc(size > 0 ? size : 1);
+            if (copy == NULL)
+                return -ENOMEM;
+            struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+            dst.buf[0].mem = copy;
+            ssize_t copied = fuse_buf_copy(&dst, buf, 0);
+            if (copied != (ssize_t)size) {
+                bfs_log(LVL_ERROR, "WRITE_BUF ERROR: Failed to receive data for file=%s\n", path);
+                free(copy);
+                return copied < 0 ? copied : -EIO;
+            }
+        }
+    }
+
+    int res;
+    if (to_disk)
+        res = write_file_extents(path, fi, buf, size, offset);
+    else
+        res = write_file_data(path, fi, mem, size, offset);
+    free(copy);
+    if (res == -ENOENT)
+        bfs_log(LVL_DEBUG, "WRITE_BUF: File not found: %s\n", path);
+    if (res < 0)
+        return res;
+
+    note_write(path, fi);
+    bfs_log(LVL_DEBUG, "WRITE_BUF: Successfully wrote %d bytes to file=%s\n", res, path);
+    return res;
+}
+
+// Writes through a handle leave the metadata flush to fsync or release
+void note_write(const char *path, struct fuse_file_info *fi) {
+    OpenFile *of = get_open_file(fi);
+    if (of != NULL) {
+        pthread_mutex_lock(&open_files_lock);
+        of->dirty = 1;
+        pthread_mutex_unlock(&open_files_lock);
+    } else {
+        commit_metadata();
+    }
+}
+
+// Writes file data and updates the inode, returning -ENOENT if the file does
+// not exist. Data for the write-back cache is copied in a change section.
+// Data for the disk is written after the section that maps its blocks has
+// ended, with only the inode locked, so commits don't wait for it.
+int write_file_data(const char *path, struct fuse_file_info *fi, const char *buf, size_t size, off_t offset) {
+    if (offset + size > MAX_FILE_SIZE) {
+        bfs_log(LVL_ERROR, "WRITE ERROR: File size exceeds maximum for file=%s\n", path);
+        return -EFBIG;
+    }
+
+    begin_change();
+    int inode_idx = lock_inode(path, fi, 1);
+    if (inode_idx == -1) {
+        end_change();
         return -ENOENT;
     }
 
-    Inode *inode = &inodes[directory[file_idx].inode_num - 1];
+    if (mount_options.writeback) {
+        int bytes_written = cache_write(inode_idx, path, buf, size, offset);
+        if (bytes_written >= 0)
+            file_written(inode_idx, offset + bytes_written);
+        unlock_inode(inode_idx);
+        end_change();
+        return bytes_written;
+    }
+
+    WriteRun *runs;
+    int count;
+    int res = map_write(inode_idx, path, size, offset, &runs, &count);
+    end_change();
+    if (write_runs(runs, count, buf, offset) != 0) {
+        bfs_log(LVL_ERROR, "WRITE ERROR: Failed to write data for file=%s\n", path);
+        res = -EIO;
+    }
+    free(runs);
+    if (res < 0) {
+        unlock_inode(inode_idx);
+        return res;
+    }
+
+    finish_write(path, fi, inode_idx, offset + size);
+    return size;
+}
+
+// Writes the data in buf to the file's blocks, allocating any that are
+// missing, by copying each run of disk-contiguous blocks straight from the
+// buffers into the disk image with fuse_buf_copy(). Data in a pipe is
+// spliced without passing through memory. As in write_file_data(), only the
+// mapping happens in a change section. Returns -ENOENT if the file does not
+// exist.
+int write_file_extents(const char *path, struct fuse_file_info *fi, struct fuse_bufvec *buf, size_t size, off_t offset) {
+    static const char zero_block[BLOCK_SIZE];
     if (offset + size > MAX_FILE_SIZE) {
-        fprintf(stderr, "WRITE ERROR: File size exceeds maximum for file=%s\n", path);
+        bfs_log(LVL_ERROR, "WRITE_BUF ERROR: File size exceeds maximum for file=%s\n", path);
         return -EFBIG;
     }
 
+    begin_change();
+    int inode_idx = lock_inode(path, fi, 1);
+    if (inode_idx == -1) {
+        end_change();
+        return -ENOENT;
+    }
+
+    WriteRun *runs;
+    int count;
+    int err = map_write(inode_idx, path, size, offset, &runs, &count);
+    end_change();
+
     size_t bytes_written = 0;
-    while (bytes_written < size) {
-        size_t block_idx = (offset + bytes_written) / BLOCK_SIZE;
+    for (int i = 0; i < count; i++) {
+        WriteRun *run = &runs[i];
+        long long block_idx = (offset + bytes_written) / BLOCK_SIZE;
         size_t block_offset = (offset + bytes_written) % BLOCK_SIZE;
+        size_t tail_offset = (block_offset + run->len) % BLOCK_SIZE;
+        int tail_block = run->start + (block_offset + run->len - 1) / BLOCK_SIZE;
 
-        if (block_idx >= DIRECT_BLOCKS) {
-            fprintf(stderr, "WRITE ERROR: Indirect blocks not implemented for file=%s\n", path);
-            return -EIO;
+        // New blocks are padded with zeros so they never expose a freed file's data
+        if ((block_offset > 0 && run->head_fresh && write_block_range(run->start, 0, zero_block, block_offset) != 0) ||
+            (tail_offset > 0 && run->tail_fresh &&
+             write_block_range(tail_block, tail_offset, zero_block, BLOCK_SIZE - tail_offset) != 0)) {
+            err = -EIO;
+            break;
         }
 
-        char block[BLOCK_SIZE] = {0};
-        if (inode->block_pointers[block_idx] == 0) {
-            int block_num = find_free_block();
-            if (block_num == -1) {
-                fprintf(stderr, "WRITE ERROR: No free blocks for file=%s\n", path);
-                return -ENOSPC;
-            }
-            inode->block_pointers[block_idx] = block_num;
-            fprintf(stderr, "WRITE: Allocated new block %d for file=%s\n", block_num, path);
-        } else {
-            if (read_block(inode->block_pointers[block_idx], block) != 0) {
-                fprintf(stderr, "WRITE ERROR: Failed to read block %zu for file=%s\n", block_idx, path);
-                return -EIO;
-            }
+        cache_invalidate(run->start, tail_block - run->start + 1);
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(run->len);
+        dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        dst.buf[0].fd = fd_disk;
+        dst.buf[0].pos = (off_t)run->start * BLOCK_SIZE + block_offset;
+        ssize_t copied = fuse_buf_copy(&dst, buf, 0);
+        if (copied != (ssize_t)run->len) {
+            bfs_log(LVL_ERROR, "WRITE_BUF ERROR: Failed to write blocks %lld-%lld for file=%s\n", block_idx,
+                    block_idx + (tail_block - run->start), path);
+            err = -EIO;
+            break;
+        }
+        bytes_written += run->len;
+    }
+    free(runs);
+
+    // Keep whatever made it to disk before an error, as a short write
+    if (bytes_written == 0 && size > 0) {
+        unlock_inode(inode_idx);
+        return err;
+    }
+    finish_write(path, fi, inode_idx, offset + bytes_written);
+    return bytes_written;
+}
+
+// Extends the file to end if it is shorter and stamps the modification time.
+// Called in a change section with the inode locked exclusively.
+void file_written(int inode_idx, off_t end) {
+    Inode *inode = &inodes[inode_idx];
+    if (end > inode->size) {
+        inode->size = end;
+    }
+    inode->modification_time = time(NULL);
+
+    mark_inode_dirty(inode_idx);
+}
+
+// Updates the inode for data written to disk after the write's change section
+// ended. Called with the inode locked exclusively, which is dropped before
+// the section is entered again so the lock order holds; the inode is then
+// looked up afresh and left alone if the file went away meanwhile. Returns
+// with the inode unlocked.
+void finish_write(const char *path, struct fuse_file_info *fi, int inode_idx, off_t end) {
+    unlock_inode(inode_idx);
+    begin_change();
+    int again = lock_inode(path, fi, 1);
+    if (again == inode_idx)
+        file_written(inode_idx, end);
+    if (again != -1)
+        unlock_inode(again);
+    end_change();
+}
+
+// Maps the blocks for a write into runs of disk-contiguous blocks, allocating
+// any that are missing. Stores the runs in *runs, to be freed by the caller,
+// and their number in *count. Returns 0, or the error that stopped the
+// mapping, in which case the runs cover the write up to that point. Called in
+// a change section with the inode locked exclusively.
+int map_write(int inode_idx, const char *path, size_t size, off_t offset, WriteRun **runs, int *count) {
+    *count = 0;
+    *runs = malloc(((offset % BLOCK_SIZE + size) / BLOCK_SIZE + 1) * sizeof(WriteRun));
+    if (*runs == NULL)
+        return -ENOMEM;
+
+    size_t mapped = 0;
+    int pending = 0; // Block past the last run was new, see map_run()
+    while (mapped < size) {
+        long long block_idx = (offset + mapped) / BLOCK_SIZE;
+        size_t block_offset = (offset + mapped) % BLOCK_SIZE;
+        long long blocks = (block_offset + size - mapped + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        WriteRun *run = &(*runs)[*count];
+        int len = map_run(inode_idx, block_idx, blocks, 1, &run->start, &run->head_fresh, &run->tail_fresh, &pending);
+        if (len < 0) {
+            if (len == -ENOSPC)
+                bfs_log(LVL_ERROR, "WRITE ERROR: No free blocks for file=%s\n", path);
+            else
+                bfs_log(LVL_ERROR, "WRITE ERROR: Failed to map block %lld for file=%s\n", block_idx, path);
+            return len;
+        }
+
+        run->len = (size_t)len * BLOCK_SIZE - block_offset;
+        if (run->len > size - mapped) {
+            run->len = size - mapped;
         }
+        mapped += run->len;
+        (*count)++;
+    }
+    return 0;
+}
 
-        size_t bytes_to_write = BLOCK_SIZE - block_offset;
-        if (bytes_to_write > size - bytes_written) {
-            bytes_to_write = size - bytes_written;
+// Writes the data for the runs map_write() returned, starting at offset in
+// the file. Each run goes down as one request, and the requests are submitted
+// together a batch at a time. Existing blocks are updated in place, so nothing
+// is read back first; new blocks are padded with zeros so they never expose a
+// freed file's data. Called with the inode locked exclusively. Returns 0 or -1.
+int write_runs(const WriteRun *runs, int count, const char *buf, off_t offset) {
+    static const char zero_block[BLOCK_SIZE];
+    IoBatch batch;
+    batch.count = 0;
+    size_t bytes_written = 0;
+    for (int i = 0; i < count; i++) {
+        const WriteRun *run = &runs[i];
+        size_t block_offset = (offset + bytes_written) % BLOCK_SIZE;
+        size_t tail_offset = (block_offset + run->len) % BLOCK_SIZE; // 0 if the run ends on a block boundary
+
+        struct iovec iov[3];
+        int iovcnt = 0;
+        size_t run_offset = block_offset;
+        size_t run_size = run->len;
+        if (block_offset > 0 && run->head_fresh) {
+            iov[iovcnt].iov_base = (char *)zero_block;
+            iov[iovcnt++].iov_len = block_offset;
+            run_offset = 0;
+            run_size += block_offset;
         }
 
-        memcpy(block + block_offset, buf + bytes_written, bytes_to_write);
-        if (write_block(inode->block_pointers[block_idx], block) != 0) {
-            fprintf(stderr, "WRITE ERROR: Failed to write block %zu for file=%s\n", block_idx, path);
-            return -EIO;
+        iov[iovcnt].iov_base = (char *)buf + bytes_written;
+        iov[iovcnt++].iov_len = run->len;
+
+        if (tail_offset > 0 && run->tail_fresh) {
+            iov[iovcnt].iov_base = (char *)zero_block;
+            iov[iovcnt++].iov_len = BLOCK_SIZE - tail_offset;
+            run_size += BLOCK_SIZE - tail_offset;
         }
 
-        bytes_written += bytes_to_write;
-    }
+        if (batch.count == IO_BATCH) {
+            if (submit_batch(&batch) != 0)
+                return -1;
+            batch.count = 0;
+        }
+        batch_add(&batch, 1, (off_t)run->start * BLOCK_SIZE + run_offset, iov, iovcnt, run_size, 0);
 
-    // Update size and save metadata
-    if (offset + bytes_written > inode->size) {
-        inode->size = offset + bytes_written;
+        bytes_written += run->len;
     }
-    inode->modification_time = time(NULL);
 
-    save_metadata();
-    fprintf(stderr, "WRITE: Successfully wrote %zu bytes to file=%s\n", bytes_written, path);
-    return bytes_written;
+    return submit_batch(&batch) != 0 ? -1 : 0;
+}
+
+// Writes data to the file's blocks on disk, allocating any that are missing.
+// Called in a change section with the inode locked exclusively.
+int write_disk_data(int inode_idx, const char *path, const char *buf, size_t size, off_t offset) {
+    WriteRun *runs;
+    int count;
+    int res = map_write(inode_idx, path, size, offset, &runs, &count);
+    if (write_runs(runs, count, buf, offset) != 0) {
+        bfs_log(LVL_ERROR, "WRITE ERROR: Failed to write data for file=%s\n", path);
+        res = -EIO;
+    }
+    free(runs);
+    return res < 0 ? res : (int)size;
 }
 
 
 
 int bfs_release(const char *path, struct fuse_file_info *fi)
 {
-    fprintf(stderr, "RELEASE: path=%s\n", path);
+    bfs_log(LVL_DEBUG, "RELEASE: path=%s\n", path);
+    if (is_control_path(path)) {
+        control_release(fi);
+        return 0;
+    }
+
+    OpenFile *of = get_open_file(fi);
+    int dirty = 0;
+    if (of != NULL)
+    {
+        pthread_mutex_lock(&open_files_lock);
+        dirty = of->dirty;
+        pthread_mutex_unlock(&open_files_lock);
+    }
+
+    if (dirty && mount_options.writeback)
+    {
+        begin_change();
+        int inode_idx = lock_inode(path, fi, 1);
+        if (inode_idx != -1)
+        {
+            flush_inode_pages(inode_idx, path);
+            unlock_inode(inode_idx);
+        }
+        end_change();
+    }
+    if (dirty)
+        commit_metadata();
+    free_open_file(fi);
+
+    bfs_log(LVL_DEBUG, "RELEASE: File=%s closed successfully\n", path);
+    return 0;
+}
+
+int bfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    bfs_log(LVL_DEBUG, "FSYNC: path=%s, datasync=%d\n", path, datasync);
+    if (is_control_path(path))
+        return 0; // Nothing to write
 
-    // Nothing to do unless we implement an explicit open file table
-    fprintf(stderr, "RELEASE: File=%s closed successfully\n", path);
+    // Clear the flag first so a write racing with the flush marks it again
+    OpenFile *of = get_open_file(fi);
+    if (of != NULL)
+    {
+        pthread_mutex_lock(&open_files_lock);
+        of->dirty = 0;
+        pthread_mutex_unlock(&open_files_lock);
+    }
+
+    int res = 0;
+    begin_change();
+    int inode_idx = lock_inode(path, fi, 1);
+    if (inode_idx != -1)
+    {
+        res = flush_inode_pages(inode_idx, path);
+        unlock_inode(inode_idx);
+    }
+    end_change();
+    commit_metadata();
+    if (res < 0)
+    {
+        bfs_log(LVL_ERROR, "FSYNC ERROR: Failed to write cached data for file=%s\n", path);
+        return res;
+    }
+
+    if (sync_disk() != 0)
+    {
+        bfs_log(LVL_ERROR, "FSYNC ERROR: fsync failed: %s\n", strerror(errno));
+        return -EIO;
+    }
+
+    bfs_log(LVL_DEBUG, "FSYNC: File=%s synced successfully\n", path);
     return 0;
 }
 
 int bfs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
 {
-    fprintf(stderr, "UTIMENS: path=%s\n", path);
+    bfs_log(LVL_DEBUG, "UTIMENS: path=%s\n", path);
+    if (is_control_path(path))
+        return -EROFS;
 
-    int file_idx = find_file(path + 1);
-    if (file_idx == -1)
+    begin_change();
+    int inode_idx = lock_inode(path, fi, 1);
+    if (inode_idx == -1)
     {
-        fprintf(stderr, "UTIMENS ERROR: File not found: %s\n", path);
+        end_change();
+        bfs_log(LVL_DEBUG, "UTIMENS: File not found: %s\n", path);
         return -ENOENT;
     }
 
-    Inode *inode = &inodes[directory[file_idx].inode_num - 1];
+    Inode *inode = &inodes[inode_idx];
     inode->creation_time = tv[0].tv_sec;     // Update access time
     inode->modification_time = tv[1].tv_sec; // Update modification time
 
-    save_metadata();
-    fprintf(stderr, "UTIMENS: Updated timestamps for file=%s\n", path);
+    mark_inode_dirty(inode_idx);
+    unlock_inode(inode_idx);
+    end_change();
+    commit_metadata();
+    bfs_log(LVL_DEBUG, "UTIMENS: Updated timestamps for file=%s\n", path);
     return 0;
 }
 
+void *bfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    // Let libfuse splice the disk image buffers from read_buf to /dev/fuse,
+    // and hand write data to write_buf still in a pipe when it can go on to disk
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if ((conn->capable & FUSE_CAP_SPLICE_READ) && !mount_options.writeback && !mount_options.direct)
+        conn->want |= FUSE_CAP_SPLICE_READ;
+
+    // Threads must be started here, after FUSE has daemonized
+    log_stop = 0;
+    if (pthread_create(&log_tid, NULL, log_thread, NULL) == 0)
+        log_running = 1;
+    else
+        bfs_log(LVL_ERROR, "INIT ERROR: Failed to start log thread, messages are written as they are logged.\n");
+    writeback_stop = readahead_stop = committer_stop = 0;
+    if (pthread_create(&committer_tid, NULL, committer_thread, NULL) == 0)
+        committer_running = 1;
+    else
+        bfs_log(LVL_ERROR, "INIT ERROR: Failed to start committer thread, each operation commits on its own.\n");
+    if (mount_options.writeback)
+    {
+        if (pthread_create(&writeback_tid, NULL, writeback_thread, NULL) == 0)
+            writeback_running = 1;
+        else
+            bfs_log(LVL_ERROR, "INIT ERROR: Failed to start write-back thread, data is flushed on fsync and release only.\n");
+    }
+    if (mount_options.cache_blocks > 0)
+    {
+        if (pthread_create(&readahead_tid, NULL, readahead_thread, NULL) == 0)
+            readahead_running = 1;
+        else
+            bfs_log(LVL_ERROR, "INIT ERROR: Failed to start readahead thread, reads will not prefetch.\n");
+    }
+    return NULL;
+}
+
+void bfs_destroy(void *private_data)
+{
+    if (writeback_running)
+    {
+        pthread_mutex_lock(&wb_lock);
+        writeback_stop = 1;
+        pthread_cond_signal(&writeback_cond);
+        pthread_mutex_unlock(&wb_lock);
+        pthread_join(writeback_tid, NULL);
+        writeback_running = 0;
+    }
+    if (readahead_running)
+    {
+        pthread_mutex_lock(&ra_lock);
+        readahead_stop = 1;
+        pthread_cond_signal(&ra_cond);
+        readahead_running = 0;
+        pthread_mutex_unlock(&ra_lock);
+        pthread_join(readahead_tid, NULL);
+    }
+    if (committer_running)
+    {
+        // Requests still queued are committed before the thread exits
+        pthread_mutex_lock(&group_lock);
+        committer_stop = 1;
+        pthread_cond_signal(&group_cond);
+        pthread_mutex_unlock(&group_lock);
+        pthread_join(committer_tid, NULL);
+        committer_running = 0;
+    }
+    if (log_running)
+    {
+        __atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(log_tid, NULL);
+        log_running = 0;
+    }
+}
+
 int main(int argc, char *argv[])
 {
-    fprintf(stderr, "BFS: Starting filesystem...\n");
+    init_log();
+    init_stats();
+    mount_options.log_level = LVL_INFO;
+    bfs_log(LVL_INFO, "BFS: Starting filesystem...\n");
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    mount_options.cache_blocks = DEFAULT_CACHE_BLOCKS;
+    if (fuse_opt_parse(&args, &mount_options, bfs_opts, NULL) == -1)
+    {
+        bfs_log(LVL_ERROR, "BFS ERROR: Failed to parse mount options.\n");
+        return 1;
+    }
+
+    // The mapping goes through the page cache whatever the descriptor's flags
+    if (mount_options.mmap && mount_options.direct)
+    {
+        bfs_log(LVL_INFO, "BFS: -o direct has no effect with -o mmap, ignoring it.\n");
+        mount_options.direct = 0;
+    }
 
-    fd_disk = open("disk1", O_RDWR);
+    fd_disk = open("disk1", O_RDWR | (mount_options.direct ? O_DIRECT : 0));
     if (fd_disk < 0)
     {
-        perror("BFS ERROR: Failed to open disk file");
+        bfs_log(LVL_ERROR, "BFS ERROR: Failed to open disk file: %s\n", strerror(errno));
+        return 1;
+    }
+    bfs_log(LVL_INFO, "BFS: Disk file 'disk1' opened successfully.\n");
+    if (mount_options.direct)
+        init_buffer_pool();
+
+    if (open_disk_device() != 0)
+    {
+        bfs_log(LVL_ERROR, "BFS ERROR: Failed to open the %s disk backend.\n", disk->name);
         return 1;
     }
-    fprintf(stderr, "BFS: Disk file 'disk1' opened successfully.\n");
+    bfs_log(LVL_INFO, "BFS: Using the %s disk backend.\n", disk->name);
+
+    // The mapping already keeps the whole disk in memory, so skip the block cache
+    if (mount_options.mmap)
+        mount_options.cache_blocks = 0;
 
     initialize_inodes_and_directory();
-    fprintf(stderr, "BFS: Filesystem metadata initialized.\n");
+    bfs_log(LVL_INFO, "BFS: Filesystem metadata initialized.\n");
 
-    fprintf(stderr, "BFS: Mounting filesystem...\n");
-    int ret = fuse_main(argc, argv, &bfs_oper, NULL);
+    bfs_log(LVL_INFO, "BFS: Mounting filesystem...\n");
+    int ret = fuse_main(args.argc, args.argv, &bfs_oper, NULL);
+    fuse_opt_free_args(&args);
 
     if (ret != 0)
     {
-        fprintf(stderr, "BFS ERROR: FUSE failed to initialize or encountered an error.\n");
+        bfs_log(LVL_ERROR, "BFS ERROR: FUSE failed to initialize or encountered an error.\n");
     }
     else
     {
-        fprintf(stderr, "BFS: Filesystem unmounted successfully.\n");
+        bfs_log(LVL_INFO, "BFS: Filesystem unmounted successfully.\n");
     }
 
+    flush_all_pages();
     save_metadata();
+    pthread_mutex_lock(&flush_lock);
+    journal_checkpoint();
+    pthread_mutex_unlock(&flush_lock);
+    close_disk_device();
     close(fd_disk);
-    fprintf(stderr, "BFS: Metadata saved and disk closed.\n");
+
+    long hits, misses;
+    cache_stats(&hits, &misses);
+    bfs_log(LVL_INFO, "BFS: Block cache hits=%ld misses=%ld.\n", hits, misses);
+    if (mount_options.log_level >= LVL_INFO)
+        dump_stats();
+    bfs_log(LVL_INFO, "BFS: Metadata saved and disk closed.\n");
     return ret;
 }
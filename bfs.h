@@ -0,0 +1,141 @@
+#ifndef BFS_H
+#define BFS_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/* On-disk format shared by make_bfs and bfs */
+
+#define BFS_MAGIC 0x42465321 // "BFS!"
+#define BFS_VERSION 5        // Bump whenever the on-disk layout changes
+
+#define BLOCK_SIZE 4096
+#define TOTAL_BLOCKS 4096
+#define MAX_FILES 128
+#define FILENAME_LEN 48
+#define DIRECT_BLOCKS 8
+#define PTRS_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(int))) // Block pointers in an indirect block
+
+// Superblock structure
+typedef struct
+{
+    int magic;              // BFS_MAGIC
+    int version;            // BFS_VERSION the disk was formatted with
+    int total_blocks;       // Total number of blocks
+    int block_size;         // Block size in bytes
+    int inode_count;        // Total number of inodes
+    int inode_table_start;  // First block of the packed inode table
+    int inode_table_blocks; // Number of inode table blocks
+    int root_dir_block;     // Start block of the root directory
+    int root_dir_blocks;    // Number of root directory blocks
+    int journal_start;      // First block of the metadata journal
+    int journal_blocks;     // Number of journal blocks
+    int data_block_start;   // First block available for file data
+} Superblock;
+
+// Directory Entry structure
+typedef struct
+{
+    char name[FILENAME_LEN];
+    int inode_num; // Points to the inode for this file
+} DirectoryEntry;
+
+// A run of contiguous disk blocks backing contiguous file blocks
+typedef struct
+{
+    int file_block;  // First file block covered
+    int start_block; // Disk block backing file_block
+    int length;      // Number of blocks in the run
+} Extent;
+
+#define INLINE_EXTENTS 3 // Extents that fit in the inode itself
+#define EXTENTS_PER_BLOCK ((int)((BLOCK_SIZE - sizeof(int)) / sizeof(Extent)))
+
+// Extent block, holding all of a file's extents once they outgrow the inode
+typedef struct
+{
+    int count;
+    Extent extents[EXTENTS_PER_BLOCK]; // Sorted by file_block
+} ExtentBlock;
+
+#define INODE_EXTENTS 0x1 // Blocks are mapped by extents instead of block pointers
+
+typedef struct
+{
+    long long size; // File size in bytes
+    int flags;      // INODE_* flags
+    union
+    {
+        struct // Block pointer mapping
+        {
+            int block_pointers[DIRECT_BLOCKS];
+            int indirect_pointer;        // Pointer to a block containing indirect pointers
+            int double_indirect_pointer; // Pointer to a block of indirect block pointers
+        };
+        struct // Extent mapping (INODE_EXTENTS)
+        {
+            Extent extents[INLINE_EXTENTS]; // Sorted by file_block, unused extents have length 0
+            int extent_block;               // ExtentBlock holding the extents instead, or 0
+        };
+    };
+    time_t creation_time;
+    time_t modification_time;
+    mode_t permissions;
+    int ref_count; // Reference count for links
+} Inode;
+
+/* Metadata journal: a header block, then a log of transactions. Each
+   transaction is a JournalTransaction followed by its records, padded to
+   whole blocks; a record is a JournalRecord followed by length bytes. */
+#define JOURNAL_MAGIC 0x4A524E4C // "JRNL"
+#define JOURNAL_BLOCKS 128       // Header block plus log blocks
+
+// First journal block: where replay starts
+typedef struct
+{
+    int magic;     // JOURNAL_MAGIC
+    int tail;      // Log block (from the journal start) of the oldest transaction to replay
+    long long seq; // Sequence number of the transaction at tail
+} JournalHeader;
+
+typedef struct
+{
+    int magic;             // JOURNAL_MAGIC
+    int blocks;            // Length in blocks, this header included
+    long long seq;         // One more than the previous transaction's
+    int length;            // Bytes of records after this header
+    int records;
+    unsigned int checksum; // Over the records
+} JournalTransaction;
+
+typedef struct
+{
+    int type;   // JREC_*
+    int target; // What the record updates, see below
+    int length; // Bytes of data after this record
+} JournalRecord;
+
+#define JREC_BITMAP 1    // Block bitmap bytes starting at byte target
+#define JREC_INODE_MAP 2 // The inode bitmap
+#define JREC_ENTRY 3     // Directory entry in slot target
+#define JREC_INODE 4     // Inode target
+#define JREC_BLOCK 5     // Indirect or extent block target, in full
+#define JREC_REVOKE 6    // Block target was freed; earlier JREC_BLOCK records for it are skipped
+
+// Inodes and directory entries are packed into whole blocks; a record never
+// straddles a block boundary.
+#define INODES_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(Inode)))
+#define DIR_ENTRIES_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(DirectoryEntry)))
+
+// BFS Disk Layout
+#define SUPERBLOCK 0
+#define BITMAP_BLOCK 1
+#define INODE_MAP_BLOCK 2
+#define INODE_TABLE_START 3
+#define INODE_TABLE_BLOCKS ((MAX_FILES + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK)
+#define ROOT_DIR_BLOCK (INODE_TABLE_START + INODE_TABLE_BLOCKS)
+#define ROOT_DIR_BLOCKS ((MAX_FILES + DIR_ENTRIES_PER_BLOCK - 1) / DIR_ENTRIES_PER_BLOCK)
+#define JOURNAL_START (ROOT_DIR_BLOCK + ROOT_DIR_BLOCKS)
+#define DATA_BLOCK_START (JOURNAL_START + JOURNAL_BLOCKS)
+
+#endif
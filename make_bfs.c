@@ -4,28 +4,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-#define BLOCK_SIZE 4096
-#define TOTAL_BLOCKS 4096
-#define BITMAP_BLOCKS 2
-#define INODE_MAP_BLOCK 1
-#define INODE_TABLE_BLOCKS 8
-#define ROOT_DIR_BLOCKS 2
-#define MAX_FILES 128
-#define FILENAME_LEN 48
-
-// Superblock structure
-typedef struct {
-    int total_blocks;         // Total number of blocks
-    int block_size;           // Block size in bytes
-    int inode_count;          // Total number of inodes
-    int root_dir_block;       // Start block of the root directory
-} Superblock;
-
-// Directory Entry structure
-typedef struct {
-    char name[FILENAME_LEN];  // File name
-    int inode_num;            // Inode number
-} DirectoryEntry;
+#include "bfs.h"
 
 // Utility Functions
 int write_block(int fd, void *data, int block_num) {
@@ -48,18 +27,23 @@ int main() {
     char buffer[BLOCK_SIZE] = {0};
 
     // 1. Initialize the Superblock
-    Superblock sb = {TOTAL_BLOCKS, BLOCK_SIZE, MAX_FILES, BITMAP_BLOCKS + INODE_MAP_BLOCK + 1};
+    Superblock sb = {BFS_MAGIC, BFS_VERSION, TOTAL_BLOCKS, BLOCK_SIZE, MAX_FILES,
+                     INODE_TABLE_START, INODE_TABLE_BLOCKS,
+                     ROOT_DIR_BLOCK, ROOT_DIR_BLOCKS,
+                     JOURNAL_START, JOURNAL_BLOCKS, DATA_BLOCK_START};
     memcpy(buffer, &sb, sizeof(Superblock));
-    if (write_block(fd, buffer, 0) != 0) {
+    if (write_block(fd, buffer, SUPERBLOCK) != 0) {
         close(fd);
         return 1;
     }
-    printf("Superblock initialized.\n");
+    printf("Superblock initialized (format version %d).\n", BFS_VERSION);
 
     // 2. Initialize the Bitmap
-    memset(buffer, 0xFF, BLOCK_SIZE); // Mark all system blocks as used
-    buffer[0] = 0x03; // First three blocks (superblock + bitmap blocks) are used
-    if (write_block(fd, buffer, 1) != 0 || write_block(fd, buffer, 2) != 0) {
+    memset(buffer, 0, BLOCK_SIZE);
+    for (int i = 0; i < DATA_BLOCK_START; i++) {
+        buffer[i / 8] |= (1 << (i % 8)); // Mark all system blocks as used
+    }
+    if (write_block(fd, buffer, BITMAP_BLOCK) != 0) {
         close(fd);
         return 1;
     }
@@ -68,21 +52,21 @@ int main() {
     // 3. Initialize the Inode Map
     memset(buffer, 0, BLOCK_SIZE);
     buffer[0] = 1; // Mark the root directory inode as used
-    if (write_block(fd, buffer, 3) != 0) {
+    if (write_block(fd, buffer, INODE_MAP_BLOCK) != 0) {
         close(fd);
         return 1;
     }
     printf("Inode map initialized.\n");
 
     // 4. Initialize the Inode Table
-    for (int i = 4; i < 4 + INODE_TABLE_BLOCKS; i++) {
+    for (int i = INODE_TABLE_START; i < INODE_TABLE_START + INODE_TABLE_BLOCKS; i++) {
         memset(buffer, 0, BLOCK_SIZE);
         if (write_block(fd, buffer, i) != 0) {
             close(fd);
             return 1;
         }
     }
-    printf("Inode table initialized.\n");
+    printf("Inode table initialized (%d inodes in %d blocks).\n", MAX_FILES, INODE_TABLE_BLOCKS);
 
     // 5. Initialize the Root Directory
     DirectoryEntry root_dir[2] = { {".", 1}, {"..", 1} };
@@ -92,11 +76,35 @@ int main() {
         close(fd);
         return 1;
     }
+    memset(buffer, 0, BLOCK_SIZE);
+    for (int i = sb.root_dir_block + 1; i < sb.root_dir_block + ROOT_DIR_BLOCKS; i++) {
+        if (write_block(fd, buffer, i) != 0) {
+            close(fd);
+            return 1;
+        }
+    }
     printf("Root directory initialized.\n");
 
-    // 6. Clear all remaining blocks
+    // 6. Initialize the Journal, empty with its log starting right after the header
+    JournalHeader jh = {JOURNAL_MAGIC, 1, 1};
+    memset(buffer, 0, BLOCK_SIZE);
+    memcpy(buffer, &jh, sizeof(JournalHeader));
+    if (write_block(fd, buffer, JOURNAL_START) != 0) {
+        close(fd);
+        return 1;
+    }
+    memset(buffer, 0, BLOCK_SIZE);
+    for (int i = JOURNAL_START + 1; i < JOURNAL_START + JOURNAL_BLOCKS; i++) {
+        if (write_block(fd, buffer, i) != 0) {
+            close(fd);
+            return 1;
+        }
+    }
+    printf("Journal initialized (%d blocks).\n", JOURNAL_BLOCKS);
+
+    // 7. Clear all remaining blocks
     memset(buffer, 0, BLOCK_SIZE);
-    for (int i = sb.root_dir_block + ROOT_DIR_BLOCKS; i < TOTAL_BLOCKS; i++) {
+    for (int i = DATA_BLOCK_START; i < TOTAL_BLOCKS; i++) {
         if (write_block(fd, buffer, i) != 0) {
             close(fd);
             return 1;